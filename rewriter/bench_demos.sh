@@ -0,0 +1,79 @@
+#!/bin/bash
+#
+# Measures the slowdown instrumentation costs whole programs. For each of
+# demos/01 and demos/02, builds the demo as is, instruments a copy with the
+# rewriter (test.cpp, built as in its header comment), builds that against
+# log_usage.cpp, runs both RUNS times and prints the mean wall time of a
+# run and the slowdown.
+#
+# The demos store to a handful of variables once each, so the slowdown is
+# mostly what the runtime costs a short-lived process: starting the
+# collector and writer, and the flush at exit. log_usage_bench.cpp measures
+# the cost of each store.
+#
+# ./bench_demos.sh path/to/rewriter [runs]
+#
+# CXX and CXXFLAGS pick the compiler and flags both builds use. demos/02 is
+# written for the analyzer rather than to run, so -fpermissive is needed to
+# build it.
+
+set -eou pipefail
+
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+    echo "usage: $0 [path to rewriter] [runs]" >&2
+    exit 1
+fi
+
+REWRITER="$(realpath "$1")"
+RUNS="${2:-200}"
+CXX="${CXX:-g++}"
+CXXFLAGS="${CXXFLAGS:--O2 -fpermissive -w}"
+HERE="$(cd "$(dirname "$0")" && pwd)"
+DEMOS="$HERE/../demos"
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+
+# Prints the mean wall time of running $1 $RUNS times, in microseconds.
+mean_run_us() {
+    local start end
+    start=$(date +%s%N)
+    for ((i = 0; i < RUNS; i++)); do
+        "$1" > /dev/null 2>&1
+    done
+    end=$(date +%s%N)
+    echo $(((end - start) / RUNS / 1000))
+}
+
+"$CXX" -O2 -std=gnu++17 -c "$HERE/log_usage.cpp" -o "$WORK/log_usage.o"
+
+printf "%-6s %14s %16s %9s\n" demo "baseline (us)" "instrumented (us)" slowdown
+for demo in 01 02; do
+    src="$WORK/$demo"
+    cp -r "$DEMOS/$demo" "$src"
+    # The demos' compilation databases name /src/, where the analyzer's
+    # container mounts them.
+    cat > "$src/compile_commands.json" <<EOF
+[
+    {
+        "arguments": ["$CXX", "ex.cpp", "-o", "ex"],
+        "directory": "$src",
+        "file": "ex.cpp"
+    }
+]
+EOF
+
+    "$CXX" $CXXFLAGS "$src/ex.cpp" -o "$src/baseline"
+
+    # The rewriter writes variable_names.csv to $HOME.
+    HOME="$src" "$REWRITER" "$src" "$HERE/instrumentation.cpp" > "$src/rewriter.log" 2>&1 || {
+        echo "$demo: the rewriter failed; see below" >&2
+        cat "$src/rewriter.log" >&2
+        exit 1
+    }
+    "$CXX" $CXXFLAGS -std=gnu++17 "$src/ex.cpp" "$WORK/log_usage.o" -o "$src/instrumented" -pthread
+
+    baseline=$(mean_run_us "$src/baseline")
+    instrumented=$(SA4U_TRACE_PATH="$src/trace.csv" mean_run_us "$src/instrumented")
+    awk -v demo="$demo" -v b="$baseline" -v i="$instrumented" \
+        'BEGIN { printf "%-6s %14d %16d %8.2fx\n", demo, b, i, i / (b > 0 ? b : 1) }'
+done
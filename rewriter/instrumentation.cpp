@@ -1,14 +1,291 @@
 #ifndef _instrument_noclash
 
 #ifdef __cplusplus
-extern "C"
+extern "C" {
 #endif
 void log_usage(int, unsigned, void *, unsigned long long size);
 
+/*
+ * Stores of up to 8 bytes take an inline fast path: stores that the
+ * enable bitmap and sampling let through are stamped with the TSC and
+ * appended to a per-thread buffer, and log_usage_flush_buffer hands the
+ * buffer to the runtime in log_usage.cpp when it fills. Wider stores call
+ * log_usage.
+ *
+ * A buffered reading reaches the runtime only when its thread's buffer
+ * fills or the thread exits, so it is missing from the crash-safe ring
+ * file (SA4U_TRACE_PERSIST) and late to the live stream (SA4U_TRACE_SHM).
+ * When either is on, the runtime clears _instrument_buffer_stores, and
+ * each store is handed over at once, at the cost of a call per store.
+ *
+ * count starts at _INSTRUMENT_BUFFER_ENTRIES - 1, so a thread's first store
+ * flushes at once. That registers the thread, which has its buffer flushed
+ * when it exits.
+ *
+ * At process exit only the exiting thread's buffer is flushed: the others
+ * belong to threads that may still be storing, so each thread still running
+ * loses up to _INSTRUMENT_BUFFER_ENTRIES - 1 readings. Threads that are
+ * joined before exit lose nothing.
+ */
+#define _INSTRUMENT_BUFFER_ENTRIES 64
+
+/*
+ * Variable IDs are 32-bit hashes of the variables' names, so the runtime
+ * keeps per-variable settings in tables of _INSTRUMENT_VARIABLE_SLOTS slots.
+ * _instrument_slot_ids maps IDs to slots. It is an open-addressed hash
+ * table, probed linearly from the ID's low bits, in which 0 marks a free
+ * slot; the rewriter never gives out ID 0. The runtime fills in a slot's
+ * settings before it publishes the slot's ID, and keeps a quarter of the
+ * slots free so that every probe ends. A variable without a slot gets the
+ * default settings.
+ */
+#define _INSTRUMENT_VARIABLE_SLOTS (1 << 16)
+#define _INSTRUMENT_NO_SLOT _INSTRUMENT_VARIABLE_SLOTS
+
+struct _instrument_entry {
+    unsigned varid;
+    unsigned short vartype;     /* INTEGRAL_TYPE or FLOATING_TYPE */
+    unsigned short size;        /* bytes stored */
+    unsigned sample_skip;       /* the variable's sampling threshold */
+    unsigned long long bits;    /* the stored value, zero extended */
+    unsigned long long clock;   /* TSC at the store, or 0 to stamp it at flush */
+};
+
+struct _instrument_buffer {
+    unsigned count;
+    unsigned primed;            /* set by the runtime once entries are valid */
+    unsigned long long random_state;    /* xorshift64 state, seeded when primed */
+    struct _instrument_entry entries[_INSTRUMENT_BUFFER_ENTRIES];
+};
+
+extern __thread struct _instrument_buffer _instrument_tls;
+
+extern unsigned _instrument_slot_ids[_INSTRUMENT_VARIABLE_SLOTS];
+
+/* One bit per slot, set if stores to its variable are ignored. */
+extern unsigned long long _instrument_disabled[_INSTRUMENT_VARIABLE_SLOTS / 64];
+
+/* Sampling thresholds by slot, as in log_usage: a store is logged when a
+ * uniform 32-bit random number is at least its variable's skip. */
+extern unsigned _instrument_sample_skips[_INSTRUMENT_VARIABLE_SLOTS];
+extern unsigned _instrument_default_sample_skip;
+
+/* Set if stores can be buffered: the runtime stamps readings with the TSC, and neither
+ * the crash-safe ring file nor the live shared-memory stream is on. */
+extern int _instrument_buffer_stores;
+
+void log_usage_flush_buffer(void);
+
+/* Registers an object's copy of a variable with the polling sampler. */
+void log_usage_register(int vartype, unsigned varid, const volatile void *address, unsigned long long size);
+#ifdef __cplusplus
+}
+#endif
+
+/* Returns the slot of a variable, or _INSTRUMENT_NO_SLOT if it has none. */
+static inline __attribute__((always_inline, unused)) unsigned _instrument_slot(unsigned varid) {
+    unsigned slot = varid & (_INSTRUMENT_VARIABLE_SLOTS - 1);
+    for (;;) {
+        unsigned id = __atomic_load_n(&_instrument_slot_ids[slot], __ATOMIC_ACQUIRE);
+        if (!id)
+            return _INSTRUMENT_NO_SLOT;
+        if (id == varid)
+            return slot;
+        slot = (slot + 1) & (_INSTRUMENT_VARIABLE_SLOTS - 1);
+    }
+}
+
+static inline __attribute__((always_inline, unused)) void
+_instrument_record(unsigned varid, unsigned short vartype, unsigned short size, unsigned long long bits) {
+    struct _instrument_buffer *buffer = &_instrument_tls;
+    struct _instrument_entry *entry;
+    unsigned sample_skip, slot = _instrument_slot(varid);
+    if (slot != _INSTRUMENT_NO_SLOT &&
+        (__atomic_load_n(&_instrument_disabled[slot / 64], __ATOMIC_RELAXED) >> (slot % 64)) & 1)
+        return;
+
+    /* Until the runtime primes the buffer, it samples the store itself. */
+    sample_skip = __atomic_load_n(slot != _INSTRUMENT_NO_SLOT ? &_instrument_sample_skips[slot]
+                                                              : &_instrument_default_sample_skip,
+                                  __ATOMIC_RELAXED);
+    if (sample_skip && buffer->primed) {
+        unsigned long long x = buffer->random_state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buffer->random_state = x;
+        if ((unsigned) (x >> 32) < sample_skip)
+            return;
+    }
+
+    entry = &buffer->entries[buffer->count];
+    entry->varid = varid;
+    entry->vartype = vartype;
+    entry->size = size;
+    entry->sample_skip = sample_skip;
+    entry->bits = bits;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_expect(_instrument_buffer_stores, 1)) {
+        entry->clock = __builtin_ia32_rdtsc();
+        if (__builtin_expect(++buffer->count == _INSTRUMENT_BUFFER_ENTRIES, 0))
+            log_usage_flush_buffer();
+        return;
+    }
+#endif
+    /* Without the TSC there is no cheap timestamp, and with the ring file or the live
+     * stream a buffered reading would be late or lost in a crash, so the store is logged now. */
+    entry->clock = 0;
+    buffer->count++;
+    log_usage_flush_buffer();
+}
+
+/* Logs the value at ptr. The size test is a constant, so only one branch is compiled in. */
+#define _instrument_store(vartype, varid, ptr)                                                                                   \
+    do {                                                                                                                         \
+        if (sizeof(*(ptr)) <= sizeof(unsigned long long)) {                                                                      \
+            unsigned long long _b_instrument_no_clash = 0;                                                                       \
+            __builtin_memcpy(&_b_instrument_no_clash, (const void *) (ptr),                                                      \
+                             sizeof(*(ptr)) <= sizeof(unsigned long long) ? sizeof(*(ptr)) : 0);                                 \
+            _instrument_record(varid, vartype, sizeof(*(ptr)), _b_instrument_no_clash);                                          \
+        } else {                                                                                                                 \
+            log_usage(vartype, varid, (void *) (ptr), sizeof(*(ptr)));                                                           \
+        }                                                                                                                        \
+    } while (0)
+
+/*
+ * The rewriter describes each variable a file instruments with one record
+ * in the sa4u_variables linker section, so the runtime and tools can find
+ * every variable in a binary without variable_names.csv. A record is an
+ * _instrument_variable followed by the variable's qualified name and its
+ * source file, each NUL terminated, zero padded to a multiple of 8 bytes.
+ * The section may hold zero padding between records. A variable stored to
+ * in several files has a record from each.
+ */
+#define _INSTRUMENT_VARIABLES_SECTION "sa4u_variables"
+#define _INSTRUMENT_VARIABLE_MAGIC 0x52415653u /* "SVAR" */
+
+struct _instrument_variable {
+    unsigned magic;             /* _INSTRUMENT_VARIABLE_MAGIC */
+    unsigned record_size;       /* bytes in the record, text included */
+    unsigned varid;
+    unsigned line;              /* of the first store the file instruments */
+    unsigned short size;        /* bytes stored */
+    unsigned short name_size;   /* bytes of the name, NUL included */
+    unsigned char vartype;      /* INTEGRAL_TYPE or FLOATING_TYPE */
+    unsigned char is_signed;
+    unsigned short reserved;
+};
+
+#define _instrument_describe(varid, vartype, is_signed, size, line, name, file)                                                  \
+    static const struct {                                                                                                        \
+        struct _instrument_variable header;                                                                                      \
+        char text[(sizeof(name) + sizeof(file) + 7) & ~7];                                                                       \
+    } _instrument_variable_##varid __attribute__((used, aligned(8), section(_INSTRUMENT_VARIABLES_SECTION))) = {                 \
+        {_INSTRUMENT_VARIABLE_MAGIC, sizeof(_instrument_variable_##varid), varid, line, size, sizeof(name),                      \
+         vartype, is_signed, 0},                                                                                                 \
+        name "\0" file}
+
+#ifdef __cplusplus
 #define _instrument_noclash(vartype, varid, expr, instance_no)                                                                   \
     (*({                                                                                                                         \
         typeof(expr) *_t_instrument_no_clash##instance_no = &(expr);                                                             \
-        log_usage(vartype, varid, (void *) _t_instrument_no_clash##instance_no, sizeof(*_t_instrument_no_clash##instance_no));   \
+        _instrument_store(vartype, varid, _t_instrument_no_clash##instance_no);                                                  \
         _t_instrument_no_clash##instance_no;                                                                                     \
 	}))
+#else
+/* In C an assignment is not an lvalue, so its value is logged instead. */
+#define _instrument_noclash(vartype, varid, expr, instance_no)                                                                   \
+    ({                                                                                                                           \
+        typeof(expr) _t_instrument_no_clash##instance_no = (expr);                                                               \
+        _instrument_store(vartype, varid, &_t_instrument_no_clash##instance_no);                                                 \
+        _t_instrument_no_clash##instance_no;                                                                                     \
+	})
+#endif
+
+/*
+ * Polling mode (rewriter --poll): instead of logging each store, a store
+ * site registers the object it stores to with the runtime, which snapshots
+ * every registered variable at a fixed rate. The site remembers the last
+ * address it registered, so a store only pays a load and a compare unless
+ * it stores to a different object than last time.
+ */
+#define _instrument_poll_site(vartype, varid, ptr, instance_no)                                                                  \
+    do {                                                                                                                         \
+        static const volatile void *_r_instrument_no_clash##instance_no;                                                         \
+        if (__builtin_expect(__atomic_load_n(&_r_instrument_no_clash##instance_no, __ATOMIC_RELAXED) !=                          \
+                             (const volatile void *) (ptr), 0)) {                                                                \
+            __atomic_store_n(&_r_instrument_no_clash##instance_no, (const volatile void *) (ptr), __ATOMIC_RELAXED);             \
+            log_usage_register(vartype, varid, (ptr), sizeof(*(ptr)));                                                           \
+        }                                                                                                                        \
+    } while (0)
+
+#ifdef __cplusplus
+#define _instrument_register(vartype, varid, lhs, rhs, instance_no)                                                              \
+    (*({                                                                                                                         \
+        typeof(lhs) *_t_instrument_no_clash##instance_no = &(lhs);                                                               \
+        *_t_instrument_no_clash##instance_no = (rhs);                                                                            \
+        _instrument_poll_site(vartype, varid, _t_instrument_no_clash##instance_no, instance_no);                                 \
+        _t_instrument_no_clash##instance_no;                                                                                     \
+    }))
+#else
+#define _instrument_register(vartype, varid, lhs, rhs, instance_no)                                                              \
+    ({                                                                                                                           \
+        typeof(lhs) *_t_instrument_no_clash##instance_no = &(lhs);                                                               \
+        *_t_instrument_no_clash##instance_no = (rhs);                                                                            \
+        _instrument_poll_site(vartype, varid, _t_instrument_no_clash##instance_no, instance_no);                                 \
+        *_t_instrument_no_clash##instance_no;                                                                                    \
+    })
+#endif
+/*
+ * The clang plugin (plugin.cpp) instruments the AST as the compile parses
+ * it, so it cannot expand the macros above. It wraps each store in a call
+ * to one of these instead. In C++ a store is an lvalue, which passes
+ * through _instrument_stored. In C it is a value, so it goes through the
+ * function for its type and is converted back.
+ */
+#ifdef __cplusplus
+template <typename _t_instrument_type>
+static inline __attribute__((always_inline, unused)) _t_instrument_type &
+_instrument_stored(int vartype, unsigned varid, _t_instrument_type &lvalue) {
+    _instrument_store(vartype, varid, &lvalue);
+    return lvalue;
+}
+#else
+static inline __attribute__((always_inline, unused)) unsigned long long
+_instrument_stored_int(int vartype, unsigned varid, unsigned short size, unsigned long long value) {
+    _instrument_record(varid, vartype, size, size < 8 ? value & ((1ull << (size * 8)) - 1) : value);
+    return value;
+}
+
+static inline __attribute__((always_inline, unused)) float
+_instrument_stored_float(int vartype, unsigned varid, float value) {
+    _instrument_store(vartype, varid, &value);
+    return value;
+}
+
+static inline __attribute__((always_inline, unused)) double
+_instrument_stored_double(int vartype, unsigned varid, double value) {
+    _instrument_store(vartype, varid, &value);
+    return value;
+}
+
+static inline __attribute__((always_inline, unused)) long double
+_instrument_stored_long_double(int vartype, unsigned varid, long double value) {
+    _instrument_store(vartype, varid, &value);
+    return value;
+}
+#endif
+
+/* Polling mode for the plugin, which stores through the address this returns. site is a
+ * static the plugin adds for the store site, which remembers the last address it registered,
+ * as _instrument_poll_site does. */
+static inline __attribute__((always_inline, unused)) void *
+_instrument_polled(int vartype, unsigned varid, const volatile void *address, unsigned long long size,
+                   const volatile void **site) {
+    if (__builtin_expect(__atomic_load_n(site, __ATOMIC_RELAXED) != address, 0)) {
+        __atomic_store_n(site, address, __ATOMIC_RELAXED);
+        log_usage_register(vartype, varid, address, size);
+    }
+    return (void *) address;
+}
 #endif
@@ -2,9 +2,10 @@
 from sys import argv, exit, stderr, stdout
 from typing import Any, Dict, List, IO, Set, Sequence, Tuple
 
-# Reads CSV into a dictionary relating timestamps to a map of variable ID -> value.
+# Reads CSV into a dictionary relating time bins to a map of variable ID -> value.
+# Timestamps are in nanoseconds, and are grouped into bins of resolution_ns.
 # Returns that dictionary, and a dictionary relating variable IDs to their first value.
-def read_into_dict(handle: IO) -> Tuple[Dict[int, Dict[Any, float]], Dict[Any, float]]:
+def read_into_dict(handle: IO, resolution_ns: int) -> Tuple[Dict[int, Dict[Any, float]], Dict[Any, float]]:
     result = {}
     first_values = {}
     is_first_line = True
@@ -12,12 +13,13 @@ def read_into_dict(handle: IO) -> Tuple[Dict[int, Dict[Any, float]], Dict[Any, f
         if is_first_line:
             is_first_line = False
             continue
-        [variable_id_str, timestamp_str, val_str] = line.split(',')
+        # Traces may carry a trailing sample_rate column.
+        [variable_id_str, timestamp_str, val_str] = line.split(',')[:3]
         try:
             variable_id = int(variable_id_str)
         except Exception:
             variable_id = variable_id_str
-        timestamp = int(timestamp_str)
+        timestamp = int(timestamp_str) // resolution_ns
         value = float(val_str)
         if first_values.get(variable_id, None) is None:
             first_values[variable_id] = value
@@ -101,14 +103,15 @@ def output_dict_to_csv_v2(d: Dict[int, List[Tuple[int, float]]], variable_names:
         print('', file=out)
 
 def main(argv: Sequence[str]):
-    if len(argv) != 2:
-        print(f'Usage: {argv[0]} [path to log file]', file=stderr)
+    if len(argv) not in (2, 3):
+        print(f'Usage: {argv[0]} [path to log file] [resolution in ms, default 1000]', file=stderr)
         exit(1)
+    resolution_ns = int(float(argv[2]) * 1_000_000) if len(argv) == 3 else 1_000_000_000
     variable_names = None
     with open('variable_names.csv') as fd:
         variable_names = read_variable_names(fd)
     with open(argv[1]) as fd:
-        d, first_values = read_into_dict(fd)
+        d, first_values = read_into_dict(fd, resolution_ns)
         output_dict_to_csv(d, first_values, variable_names, stdout)
         #output_dict_to_csv_v2(d, variable_names, stdout)
 
@@ -1,28 +1,149 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
 #include <cstdio>
 #include <ctime>
 #include <iostream>
-#include <fstream>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
 extern "C" {
+    #include <fcntl.h>
+    #include <signal.h>
+    #include <sys/stat.h>
+    #include <sys/uio.h>
     #include <unistd.h>
 }
 
+#ifdef SA4U_TRACE_URING
+#include <liburing.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#include "trace_format.h"
+#include "trace_gorilla.h"
+#include "trace_persist.h"
+#include "trace_shm.h"
+
+// The inline fast path that instrumented code uses; see the buffer ABI
+// there.
+#include "instrumentation.cpp"
+
 #define INTEGRAL_TYPE 0 
 #define FLOATING_TYPE 1
 
-// compute MSE
-static double mse(double a, double b);
+// Number of readings each thread can buffer before the collector drains it.
+// Must be a power of two.
+#define RING_CAPACITY (1 << 15)
+
+// How often the collector thread drains the per-thread rings.
+#define DRAIN_PERIOD_MS 10
+
+// Slots in the per-variable tables (see _instrument_slot_ids).
+#define VARIABLE_SLOTS (1 << 16)
+
+// Slots given out at most, so that a quarter of them stay free.
+#define MAX_SLOTS_USED (VARIABLE_SLOTS / 4 * 3)
+
+// Default for SA4U_TRACE_SAMPLE_RATE: the fraction of stores logged when
+// rates are not adapted.
+#define DEFAULT_SAMPLE_RATE 0.1
+
+// How often the collector re-calibrates the TSC against CLOCK_MONOTONIC.
+#define CLOCK_RESYNC_MS 1000
+
+// How long the first calibration of the TSC measures for.
+#define CLOCK_CALIBRATION_MS 5
+
+// How often the collector re-targets adaptive sampling rates, and the
+// lowest rate it will pick.
+#define ADAPT_PERIOD_MS 1000
+#define MIN_SAMPLE_RATE 1e-4
+
+// Slots in each thread's cache of last logged values, used to suppress
+// repeated stores. Must be a power of two.
+#define LAST_VALUE_SLOTS 4096
+
+// Number of physical measurements in get_varinfo_measurements().
+#define NUM_MEASUREMENTS 11
+
+// Scale factors each variable is compared to each measurement under, so
+// that a variable kept in other units (cm, mm, centidegrees, 1e-7 degrees)
+// still matches it.
+#define NUM_FIT_SCALES 10
+static const double fit_scales[NUM_FIT_SCALES] = {1.0, -1.0, 10.0, 100.0, 1000.0, 1e6, 1e7, 1e-1, 1e-2, 1e-3};
+
+// Fewest samples a variable needs before its fits count as evidence.
+#define MIN_FIT_SAMPLES 10
+#define DEFAULT_FIT_THRESHOLD 0.01
+
+// Matches printed to stderr at exit; the evidence file has all of them.
+#define MAX_EVIDENCE_LINES 10
 
-// returns a lock
+// Buckets in each variable's histogram of log2 magnitudes. Bucket 0 holds
+// zeros; bucket b holds magnitudes in [2^(b - HISTOGRAM_BIAS), 2^(b + 1 - HISTOGRAM_BIAS)),
+// with the first and last nonzero buckets also taking everything beyond.
+#define HISTOGRAM_BUCKETS 64
+#define HISTOGRAM_BIAS 32
+
+// Records per arena chunk, and chunks the arena allocates at a time.
+#define CHUNK_RECORDS 64
+#define CHUNKS_PER_SLAB 64
+
+// Defaults for the SA4U_TRACE_PATH and SA4U_TRACE_INTERVAL environment
+// variables. The default path is per run, so parallel runs do not clobber
+// each other's traces; trace_merge combines them.
+#define DEFAULT_TRACE_PATH "/home/rewriter/log.%t.csv"
+#define DEFAULT_FLUSH_PERIOD_S 10
+
+// Size of the writer's output buffer.
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+// O_DIRECT writes must be aligned to, and a multiple of, this many bytes.
+#define DIRECT_IO_ALIGNMENT 4096
+
+// How often the writer checks the enable file for changes.
+#define ENABLE_POLL_MS 250
+
+// Threads that can have a ring in the crash-safe ring file.
+#define DEFAULT_PERSIST_THREADS 64
+
+// Slots in a shared-memory stream this process creates.
+#define DEFAULT_SHM_SLOTS (1 << 20)
+
+// How often registered variables are snapshotted in polling mode.
+#define DEFAULT_POLL_HZ 50.0
+
+// Addresses the polling registry holds. Registrations beyond it are ignored.
+#define MAX_POLLED_VARIABLES (1 << 16)
+
+// Variables read per process_vm_readv call when polling.
+#define POLL_BATCH 1024
+
+// Self-profiling histograms are log-linear, as in HdrHistogram: values
+// below PROFILE_SUB_BUCKETS are exact, and each power of two above is
+// split into PROFILE_SUB_BUCKETS buckets, for about 6% relative error.
+#define PROFILE_SUB_BUCKET_BITS 4
+#define PROFILE_SUB_BUCKETS (1 << PROFILE_SUB_BUCKET_BITS)
+#define PROFILE_BUCKETS ((64 - PROFILE_SUB_BUCKET_BITS + 1) * PROFILE_SUB_BUCKETS)
+
+// Guards the pending readings shared by the collector and the writer.
+// Instrumented stores never take it.
 std::mutex& get_lock() {
     static std::mutex lock;
     return lock;
@@ -30,14 +151,15 @@ std::mutex& get_lock() {
 
 // returns an array of physical measurements
 // SIM_Aircraft.cpp fills this in directly
-std::array<double, 11>& get_varinfo_measurements() {
-    static std::array<double, 11> varinfo_measurements;
+std::array<double, NUM_MEASUREMENTS>& get_varinfo_measurements() {
+    static std::array<double, NUM_MEASUREMENTS> varinfo_measurements;
     return varinfo_measurements;
 }
 
 // returns a map relating variable IDs to the number of updates
-static std::unordered_map<unsigned, unsigned long>& get_variables_to_updates() {
-    static std::unordered_map<unsigned, unsigned long> variables_to_updates;
+// The collector estimates these from the samples and their rates.
+static std::unordered_map<unsigned, double>& get_variables_to_updates() {
+    static std::unordered_map<unsigned, double> variables_to_updates;
     static bool is_first = true;
     if (is_first) {
         variables_to_updates.reserve(50000);
@@ -46,110 +168,2377 @@ static std::unordered_map<unsigned, unsigned long>& get_variables_to_updates() {
     return variables_to_updates;
 }
 
-// returns a map relating variable names to MSE w/ measurements
-static std::unordered_map<unsigned, std::array<double, 11>>& get_variables_to_values() {
-    static std::unordered_map<unsigned, std::array<double, 11>> variables_to_values;
-    static bool is_first = true;
-    if (is_first) {
-        variables_to_values.reserve(50000);
-        is_first = false;
+// How well a variable's samples match each measurement, under each of
+// fit_scales. Sums are weighted like variable_stats. The squared error
+// under scale k, sum w (x - k y)^2, is value_sq - 2 k cross + k^2
+// measurement_sq, so only these three sums are kept per sample.
+struct measurement_fit {
+    unsigned long long samples = 0;
+    double value_sq = 0.0;                          // sum of w x^2
+    double measurement_sq[NUM_MEASUREMENTS] = {};   // sum of w y^2
+    double cross[NUM_MEASUREMENTS] = {};            // sum of w x y
+};
+
+// Returns a fit's squared error against measurement i under scale k.
+static double fit_error(const measurement_fit &fit, int i, double k) {
+    return std::max(0.0, fit.value_sq - 2.0 * k * fit.cross[i] + k * k * fit.measurement_sq[i]);
+}
+
+// returns a map relating variable IDs to MSE w/ measurements
+// Guarded by get_lock(). Never destroyed, so the exit-time flush can use it.
+static std::unordered_map<unsigned, measurement_fit>& get_variables_to_fits() {
+    static auto *variables_to_fits = [] {
+        auto *fits = new std::unordered_map<unsigned, measurement_fit>;
+        fits->reserve(50000);
+        return fits;
+    }();
+    return *variables_to_fits;
+}
+
+// Folds a sample and the measurements it was paired with into a fit.
+static void update_fit(measurement_fit &fit, double value, double weight,
+                       const std::array<double, NUM_MEASUREMENTS> &measurements) {
+    if (!std::isfinite(value)) return;
+    fit.samples++;
+    fit.value_sq += weight * value * value;
+    for (int i = 0; i < NUM_MEASUREMENTS; i++) {
+        double y = measurements[i];
+        fit.measurement_sq[i] += weight * y * y;
+        fit.cross[i] += weight * value * y;
     }
-    return variables_to_values;
 }
 
-// Returns a map relating variable IDs to a sequence of (timestamp, value) pair.
-static std::unordered_map<unsigned, std::vector<std::tuple<time_t, double>>>& get_variable_history() {
-    static std::unordered_map<unsigned, std::vector<std::tuple<time_t, double>>> variable_readings;
-    static bool first_use = true;
-    if (first_use) {
-        variable_readings.reserve(50000);
-        first_use = false;
+// Fixed-size block of records. A variable's records are a linked list of
+// these, so appending never copies earlier records.
+struct record_chunk {
+    record_chunk *next;
+    unsigned used;
+    trace_record records[CHUNK_RECORDS];
+};
+
+// A variable's records, oldest chunk first.
+struct record_chain {
+    record_chunk *head = nullptr;
+    record_chunk *tail = nullptr;
+    unsigned long long count = 0;
+    unsigned long long chunks = 0;
+};
+
+// Pool of record chunks. Chunks are carved out of slabs that are never
+// freed; chains the writer is done with go back on the free list.
+// Guarded by get_lock().
+class chunk_pool {
+ public:
+    record_chunk *allocate() {
+        if (!free_list) {
+            record_chunk *slab = new record_chunk[CHUNKS_PER_SLAB];
+            for (int i = 0; i < CHUNKS_PER_SLAB; i++) {
+                slab[i].next = free_list;
+                free_list = &slab[i];
+            }
+            slabs++;
+        }
+        record_chunk *chunk = free_list;
+        free_list = chunk->next;
+        chunk->next = nullptr;
+        chunk->used = 0;
+        return chunk;
+    }
+
+    // Returns every chunk of a chain to the pool.
+    void release(record_chain &chain) {
+        if (!chain.head) return;
+        chain.tail->next = free_list;
+        free_list = chain.head;
+        chain = record_chain();
     }
-    return variable_readings;
+
+    // Bytes of chunks allocated so far, in use or free.
+    size_t footprint() const { return slabs * CHUNKS_PER_SLAB * sizeof(record_chunk); }
+
+ private:
+    record_chunk *free_list = nullptr;
+    size_t slabs = 0;
+};
+
+static chunk_pool& get_chunk_pool() {
+    static auto *pool = new chunk_pool;
+    return *pool;
 }
 
-extern "C" void log_usage(int vartype, unsigned varid, void *data, unsigned long long size) {
-    double r = static_cast<double>(rand()) / static_cast<double>(RAND_MAX);
-    if (r > 0.1) {
-        // Only log 10% of the time.
+// Appends a record to a chain in constant time. Call with get_lock() held.
+static void append_record(record_chain &chain, const trace_record &r) {
+    if (!chain.tail || chain.tail->used == CHUNK_RECORDS) {
+        record_chunk *chunk = get_chunk_pool().allocate();
+        if (chain.tail) chain.tail->next = chunk;
+        else chain.head = chunk;
+        chain.tail = chunk;
+        chain.chunks++;
+    }
+    chain.tail->records[chain.tail->used++] = r;
+    chain.count++;
+}
+
+// Relates variable IDs to the records logged for them.
+using variable_records = std::unordered_map<unsigned, record_chain>;
+
+// Returns the records drained since the last flush.
+// Guarded by get_lock(). Never destroyed, so the exit-time flush can use it.
+static variable_records& get_pending_readings() {
+    static auto *pending = [] {
+        auto *p = new variable_records;
+        p->reserve(50000);
+        return p;
+    }();
+    return *pending;
+}
+
+// Running summary of one variable's samples. Samples are weighted by the
+// inverse of their sampling rate, so the moments estimate every store.
+struct variable_stats {
+    unsigned long long samples = 0;
+    unsigned long long nonfinite = 0;   // NaN and infinite samples, otherwise ignored
+    double weight = 0.0;                // estimated number of stores
+    double mean = 0.0;
+    double m2 = 0.0;                    // weighted sum of squared deviations
+    double min = INFINITY;
+    double max = -INFINITY;
+    double last = 0.0;
+    unsigned long long histogram[HISTOGRAM_BUCKETS] = {};
+
+    // Moments of each measurement at the times this variable was sampled,
+    // and its co-moments with the variable.
+    double measurement_mean[NUM_MEASUREMENTS] = {};
+    double measurement_m2[NUM_MEASUREMENTS] = {};
+    double comoment[NUM_MEASUREMENTS] = {};
+};
+
+// Returns the histogram bucket of a finite value.
+static int histogram_bucket(double value) {
+    if (value == 0.0) return 0;
+    int bucket = ilogb(value) + HISTOGRAM_BIAS;
+    return std::min(HISTOGRAM_BUCKETS - 1, std::max(1, bucket));
+}
+
+// Folds a sample into a variable's summary with West's weighted update.
+static void update_stats(variable_stats &stats, double value, double weight,
+                         const std::array<double, NUM_MEASUREMENTS> &measurements) {
+    stats.samples++;
+    stats.last = value;
+    if (!std::isfinite(value)) {
+        stats.nonfinite++;
         return;
     }
 
-    std::unordered_map<unsigned, std::vector<std::tuple<time_t, double>>> &variable_readings = get_variable_history();
-    std::mutex &lock = get_lock();
-    if (!data) return;
+    stats.weight += weight;
+    double ratio = weight / stats.weight;
+    double dx = value - stats.mean;
+    stats.mean += dx * ratio;
+    stats.m2 += weight * dx * (value - stats.mean);
+    stats.min = std::min(stats.min, value);
+    stats.max = std::max(stats.max, value);
+    stats.histogram[histogram_bucket(value)]++;
 
-    double val = 0.0;
+    for (int i = 0; i < NUM_MEASUREMENTS; i++) {
+        double dy = measurements[i] - stats.measurement_mean[i];
+        stats.measurement_mean[i] += dy * ratio;
+        stats.measurement_m2[i] += weight * dy * (measurements[i] - stats.measurement_mean[i]);
+        stats.comoment[i] += weight * dx * (measurements[i] - stats.measurement_mean[i]);
+    }
+}
 
-    if (vartype == INTEGRAL_TYPE) {
-        switch (size) {
-            case sizeof(char):
-                char ch;
-                memcpy(&ch, data, 1);
-                val = ch;
-                break;
-            case sizeof(short):
-                short s;
-                mempcpy(&s, data, sizeof(short));
-                val = s;
-                break;
-            case sizeof(int):
-                int i;
-                memcpy(&i, data, sizeof(int));
-                val = i;
-                break;
-            case sizeof(long):
-                long l;
-                memcpy(&l, data, sizeof(long));
-                val = l;
-                break;
-            default:
-                break;
+// Returns the running summaries kept in stats mode. Guarded by get_lock().
+static std::unordered_map<unsigned, variable_stats>& get_variable_stats() {
+    static auto *stats = new std::unordered_map<unsigned, variable_stats>;
+    return *stats;
+}
+
+// Runtime settings, read once from the environment.
+struct trace_config {
+    // SA4U_TRACE_PATH: file the trace is appended to. "%p" in it stands
+    // for the process ID, "%t" for the run's tag and "%%" for "%". Threads
+    // still running at exit lose the readings in their fast path buffers,
+    // up to 63 each; join them first to keep every reading.
+    std::string path = DEFAULT_TRACE_PATH;
+
+    // SA4U_TRACE_TAG: names the run in the trace path (default: the
+    // process ID).
+    std::string tag;
+
+    // SA4U_TRACE_INTERVAL: seconds between flushes.
+    unsigned flush_period_s = DEFAULT_FLUSH_PERIOD_S;
+
+    // SA4U_TRACE_BACKEND: "write" (default), "direct" for O_DIRECT, or
+    // "uring" for io_uring when built with -DSA4U_TRACE_URING.
+    std::string backend = "write";
+
+    // SA4U_TRACE_FORMAT: "csv" (default), "binary" (see trace_format.h),
+    // or "gorilla" for binary with each variable's records compressed.
+    bool binary = false;
+    bool compress = false;
+
+    // SA4U_TRACE_SAMPLE_RATE: fraction of stores logged, or the starting
+    // rate when adapting.
+    double sample_rate = DEFAULT_SAMPLE_RATE;
+
+    // SA4U_TRACE_TARGET_RATE: if set, each variable's rate is adapted so
+    // that it logs about this many samples per second.
+    double target_rate = 0.0;
+
+    // SA4U_TRACE_MODE: "trace" (default) logs every sampled reading;
+    // "stats" keeps only per-variable summaries and writes snapshots of
+    // them to the trace path.
+    bool stats = false;
+
+    // SA4U_TRACE_CHANGES_ONLY: if set to 1, a store that repeats its
+    // variable's last logged value is not logged; runs of them are
+    // reported as TRACE_FLAG_RUN records instead. Every change is logged,
+    // so the sampling rate settings do not apply.
+    bool changes_only = false;
+
+    // SA4U_TRACE_DEADBAND: in changes-only mode, stores within this
+    // distance of the last logged value count as repeats (default 0).
+    double deadband = 0.0;
+
+    // SA4U_TRACE_DEADBAND_FILE: CSV of variable_id,deadband lines that
+    // override the deadband for individual variables.
+    std::string deadband_file;
+
+    // SA4U_TRACE_CLOCK: "tsc" (default, where the TSC is invariant) or
+    // "monotonic" to stamp readings with clock_gettime(CLOCK_MONOTONIC).
+    bool allow_tsc = true;
+
+    // SA4U_TRACE_FIT: set to 1 to compare variables to the simulator's
+    // measurements, and write the matches to <path>.evidence.csv at exit.
+    bool fit = false;
+
+    // SA4U_TRACE_FIT_THRESHOLD: largest relative error, sum (x - k y)^2 /
+    // sum x^2, at which a variable is reported as k times a measurement.
+    double fit_threshold = DEFAULT_FIT_THRESHOLD;
+
+    // SA4U_TRACE_MEASUREMENT_NAMES: comma-separated names for the
+    // measurements, in order, to use in the evidence report.
+    std::vector<std::string> measurement_names;
+
+    // SA4U_TRACE_VARIABLE_NAMES: the name,id CSV the rewriter writes
+    // (default $HOME/variable_names.csv), to name variables in the
+    // evidence report that the binary does not describe.
+    std::string variable_names;
+
+    // SA4U_TRACE_ENABLE_FILE: CSV of variable_id,enabled lines, keyed by
+    // the IDs in the rewriter's variable_names.csv. Stores to a variable
+    // with enabled 0 are ignored. A "*,0" line disables every variable not
+    // listed with enabled 1. The writer reloads the file when it changes.
+    std::string enable_file;
+
+    // SA4U_TRACE_PERSIST: if set, a file to keep each thread's ring in, so
+    // that its last readings survive a crash. See trace_persist.h; the
+    // trace_recover tool reads it. Stores then skip the inline fast path's
+    // buffer, which would hold up to _INSTRUMENT_BUFFER_ENTRIES - 1 of a
+    // thread's readings outside the file.
+    std::string persist_path;
+
+    // SA4U_TRACE_PERSIST_THREADS: threads the file has room for. Threads
+    // beyond that keep their rings in memory.
+    unsigned persist_threads = DEFAULT_PERSIST_THREADS;
+
+    // SA4U_TRACE_SHM: if set, the POSIX shared-memory segment (e.g.
+    // "/sa4u") every drained reading is also published to, live. See
+    // trace_shm.h. Stores then skip the inline fast path's buffer, so that
+    // readers see a reading no later than the next drain.
+    std::string shm_name;
+
+    // SA4U_TRACE_SHM_SLOTS: capacity of the segment, if this process
+    // creates it.
+    unsigned long shm_slots = DEFAULT_SHM_SLOTS;
+
+    // SA4U_TRACE_POLL_HZ: how often variables registered by code the
+    // rewriter instrumented with --poll are snapshotted into the trace.
+    double poll_hz = DEFAULT_POLL_HZ;
+
+    // SA4U_TRACE_PROFILE: if set to 1, each thread records histograms of
+    // what log_usage costs it, which are merged at every flush into
+    // <trace path>.profile.csv, with each variable's share of the cost in
+    // <trace path>.profile_variables.csv. It also prints a one-line summary
+    // of every flush to stderr.
+    bool profile = false;
+};
+
+// Returns path with "%p" replaced by the process ID, "%t" by tag and "%%"
+// by "%".
+static std::string expand_trace_path(const std::string &path, const std::string &tag) {
+    std::string expanded;
+    for (size_t i = 0; i < path.size(); i++) {
+        if (path[i] != '%' || i + 1 == path.size()) {
+            expanded += path[i];
+            continue;
         }
-    } else if (vartype == FLOATING_TYPE) {
-        switch (size) {
-            case sizeof(float):
-                float f;
-                memcpy(&f, data, sizeof(float));
-                val = f;
-                break;
-            case sizeof(double):
-                memcpy(&val, data, sizeof(double));
-                break;
-            default:
-                break;
+        char c = path[++i];
+        if (c == 'p')
+            expanded += std::to_string(getpid());
+        else if (c == 't')
+            expanded += tag;
+        else if (c == '%')
+            expanded += '%';
+        else
+            expanded.append({'%', c});
+    }
+    return expanded;
+}
+
+static const trace_config& get_config() {
+    static trace_config config = [] {
+        trace_config c;
+        if (const char *path = getenv("SA4U_TRACE_PATH"))
+            c.path = path;
+        const char *tag = getenv("SA4U_TRACE_TAG");
+        c.tag = tag && *tag ? tag : std::to_string(getpid());
+        c.path = expand_trace_path(c.path, c.tag);
+        if (const char *interval = getenv("SA4U_TRACE_INTERVAL")) {
+            long seconds = strtol(interval, nullptr, 10);
+            if (seconds > 0) c.flush_period_s = seconds;
+        }
+        if (const char *backend = getenv("SA4U_TRACE_BACKEND"))
+            c.backend = backend;
+        if (const char *format = getenv("SA4U_TRACE_FORMAT")) {
+            c.compress = strcmp(format, "gorilla") == 0;
+            c.binary = c.compress || strcmp(format, "binary") == 0;
+        }
+        if (const char *rate = getenv("SA4U_TRACE_SAMPLE_RATE")) {
+            double r = strtod(rate, nullptr);
+            if (r > 0.0 && r <= 1.0) c.sample_rate = r;
+        }
+        if (const char *target = getenv("SA4U_TRACE_TARGET_RATE"))
+            c.target_rate = std::max(0.0, strtod(target, nullptr));
+        if (const char *mode = getenv("SA4U_TRACE_MODE"))
+            c.stats = strcmp(mode, "stats") == 0;
+        if (const char *changes_only = getenv("SA4U_TRACE_CHANGES_ONLY"))
+            c.changes_only = strcmp(changes_only, "1") == 0;
+        if (const char *deadband = getenv("SA4U_TRACE_DEADBAND"))
+            c.deadband = std::max(0.0, strtod(deadband, nullptr));
+        if (const char *deadband_file = getenv("SA4U_TRACE_DEADBAND_FILE"))
+            c.deadband_file = deadband_file;
+        if (const char *clock = getenv("SA4U_TRACE_CLOCK"))
+            c.allow_tsc = strcmp(clock, "monotonic") != 0;
+        if (const char *fit = getenv("SA4U_TRACE_FIT"))
+            c.fit = strcmp(fit, "1") == 0;
+        if (const char *threshold = getenv("SA4U_TRACE_FIT_THRESHOLD"))
+            c.fit_threshold = std::max(0.0, strtod(threshold, nullptr));
+        for (int i = 0; i < NUM_MEASUREMENTS; i++)
+            c.measurement_names.push_back("measurement_" + std::to_string(i));
+        if (const char *names = getenv("SA4U_TRACE_MEASUREMENT_NAMES")) {
+            std::string list = names;
+            size_t start = 0;
+            for (int i = 0; i < NUM_MEASUREMENTS && start <= list.size(); i++) {
+                size_t end = std::min(list.find(',', start), list.size());
+                if (end > start) c.measurement_names[i] = list.substr(start, end - start);
+                start = end + 1;
+            }
+        }
+        if (const char *home = getenv("HOME"))
+            c.variable_names = std::string(home) + "/variable_names.csv";
+        if (const char *variable_names = getenv("SA4U_TRACE_VARIABLE_NAMES"))
+            c.variable_names = variable_names;
+        if (const char *enable_file = getenv("SA4U_TRACE_ENABLE_FILE"))
+            c.enable_file = enable_file;
+        if (const char *persist = getenv("SA4U_TRACE_PERSIST"))
+            c.persist_path = expand_trace_path(persist, c.tag);
+        if (const char *threads = getenv("SA4U_TRACE_PERSIST_THREADS")) {
+            long n = strtol(threads, nullptr, 10);
+            if (n > 0) c.persist_threads = n;
+        }
+        if (const char *shm = getenv("SA4U_TRACE_SHM"))
+            c.shm_name = shm;
+        if (const char *slots = getenv("SA4U_TRACE_SHM_SLOTS")) {
+            unsigned long n = strtoul(slots, nullptr, 10);
+            if (n > 0) c.shm_slots = n;
+        }
+        if (const char *poll_hz = getenv("SA4U_TRACE_POLL_HZ")) {
+            double hz = strtod(poll_hz, nullptr);
+            if (hz > 0.0) c.poll_hz = hz;
+        }
+        if (const char *profile = getenv("SA4U_TRACE_PROFILE"))
+            c.profile = strcmp(profile, "1") == 0;
+        return c;
+    }();
+    return config;
+}
+
+// Single-producer, single-consumer ring of readings.
+// Each instrumented thread owns one ring and is its only producer;
+// the collector thread is its only consumer.
+struct trace_ring {
+    // RING_CAPACITY readings, in the ring file or in heap_readings.
+    trace_record *readings = nullptr;
+
+    // The ring's region of the ring file, or nullptr if it has none.
+    trace_persist_region *region = nullptr;
+
+    // The producer's and the consumer's indices are on cache lines of
+    // their own, so that neither's stores invalidate the other's line.
+
+    // Next slot the producer writes. Only the producer stores to it.
+    alignas(64) std::atomic<unsigned long long> head{0};
+
+    // The producer's last view of tail, so that the common path does not
+    // touch the consumer's cache line.
+    unsigned long long cached_tail = 0;
+
+    // State of the producer's xorshift sampler. Never zero.
+    uint64_t random_state = 0;
+
+    // Next slot the consumer reads. Only the consumer stores to it.
+    alignas(64) std::atomic<unsigned long long> tail{0};
+
+    // In changes-only mode, the producer's direct-mapped cache of the last
+    // value it logged for each variable.
+    alignas(64) std::unique_ptr<struct last_value[]> last_values;
+
+    // Readings discarded because the ring was full.
+    std::atomic<unsigned long long> dropped{0};
+
+    // Nanoseconds the producer spent off the fast path.
+    std::atomic<unsigned long long> stall_ns{0};
+
+    // Set once the owning thread exits. The collector frees the ring after
+    // draining it.
+    std::atomic<bool> retired{false};
+
+    // Next ring in the registry. Only the collector reads it, and only the
+    // collector changes it once the ring is published.
+    trace_ring *next = nullptr;
+
+    std::unique_ptr<trace_record[]> heap_readings;
+};
+
+// Lock-free stack of every ring that has not yet been freed.
+// Threads push their ring once; only the collector unlinks rings.
+static std::atomic<trace_ring*> ring_list{nullptr};
+
+// Totals over freed rings, and over live rings as of the last drain.
+// Updated by the collector.
+static std::atomic<unsigned long long> total_dropped{0};
+static std::atomic<unsigned long long> total_stall_ns{0};
+static std::atomic<unsigned long long> live_dropped{0};
+static std::atomic<unsigned long long> live_stall_ns{0};
+
+// Returns nanoseconds on a monotonic clock.
+static unsigned long long monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// True if readings are stamped with the TSC rather than CLOCK_MONOTONIC.
+// Set once, before any thread has a ring.
+static bool tsc_clock = false;
+
+// Set if the inline fast path may buffer stores: readings are stamped
+// with the TSC, and neither the ring file nor the live stream is on.
+extern "C" {
+int _instrument_buffer_stores = 0;
+}
+
+// Returns the raw timestamp for a reading: TSC ticks, or nanoseconds.
+static inline uint64_t read_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (tsc_clock) return __rdtsc();
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// True if the TSC ticks at a constant rate in every power state.
+static bool has_invariant_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return edx & (1 << 8);
+#endif
+    return false;
+}
+
+// Maps raw timestamps to CLOCK_MONOTONIC: ns = ns + (raw - raw) * ns_per_tick.
+// Only the thread draining the rings updates or uses it after startup.
+struct clock_calibration {
+    uint64_t raw;
+    unsigned long long ns;
+    double ns_per_tick;
+};
+static clock_calibration calibration;
+
+// When the trace began, on CLOCK_MONOTONIC and on the wall clock.
+static unsigned long long trace_start_ns;
+static long long trace_start_wall_ns;
+
+// The ring file, or nullptr. Set before any thread has a ring.
+static trace_persist_header *persist_file = nullptr;
+
+// Copies the calibration to the ring file, for recovery.
+static void publish_calibration() {
+    if (!persist_file) return;
+    uint64_t seq = persist_file->calibration_seq.load(std::memory_order_relaxed);
+    persist_file->calibration_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    persist_file->calibration_raw = calibration.raw;
+    persist_file->calibration_ns = calibration.ns - trace_start_ns;
+    persist_file->ns_per_tick = calibration.ns_per_tick;
+    persist_file->calibration_seq.store(seq + 2, std::memory_order_release);
+}
+
+// Takes a new calibration point, and re-measures the TSC rate since the
+// previous one.
+static void resync_clock() {
+    uint64_t raw = read_clock();
+    unsigned long long ns = monotonic_ns();
+    if (tsc_clock && raw > calibration.raw)
+        calibration.ns_per_tick = static_cast<double>(ns - calibration.ns) / (raw - calibration.raw);
+    calibration.raw = raw;
+    calibration.ns = ns;
+    publish_calibration();
+}
+
+static bool init_clock() {
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    trace_start_wall_ns = wall.tv_sec * 1000000000ll + wall.tv_nsec;
+    trace_start_ns = monotonic_ns();
+
+    const trace_config &config = get_config();
+    tsc_clock = config.allow_tsc && has_invariant_tsc();
+    _instrument_buffer_stores = tsc_clock && config.persist_path.empty() && config.shm_name.empty();
+    calibration = {read_clock(), monotonic_ns(), 1.0};
+    if (tsc_clock) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(CLOCK_CALIBRATION_MS));
+        resync_clock();
+    }
+    return true;
+}
+
+// Converts a raw timestamp to nanoseconds since the trace began.
+static long long to_trace_ns(uint64_t raw) {
+    long long ticks = static_cast<long long>(raw - calibration.raw);
+    return static_cast<long long>(calibration.ns - trace_start_ns) + llround(ticks * calibration.ns_per_tick);
+}
+
+// Returns the raw timestamp log_usage stamps readings with. For benchmarks.
+extern "C" unsigned long long log_usage_clock() {
+    return read_clock();
+}
+
+// This thread's ring, or nullptr before its first sampled store and once
+// the ring is retired.
+static thread_local trace_ring *current_ring = nullptr;
+
+// Set once this thread's ring is retired. The collector may free the ring
+// at any time after, so stores the thread makes later, from destructors
+// run at exit, are counted as dropped rather than logged.
+static thread_local bool ring_retired = false;
+
+// The last value a thread logged for a variable, and how many stores have
+// repeated it since.
+struct last_value {
+    uint32_t varid;
+    uint32_t repeats;
+    uint64_t bits;
+    trace_type type;
+};
+
+// An ID no variable has, marking an empty last_value slot.
+#define NO_VARIABLE 0xffffffffu
+
+static void flush_runs(trace_ring *ring);
+static void flush_buffer(_instrument_buffer &buffer);
+
+// Marks the thread's ring as retired when the thread exits.
+struct ring_retirer {
+    trace_ring *ring = nullptr;
+    ~ring_retirer() {
+        if (!ring) return;
+        flush_buffer(_instrument_tls);
+        flush_runs(ring);
+        current_ring = nullptr;
+        ring_retired = true;
+        trace_ring *retiring = ring;
+        ring = nullptr;
+        retiring->retired.store(true, std::memory_order_release);
+    }
+};
+
+static_assert(_INSTRUMENT_VARIABLE_SLOTS == VARIABLE_SLOTS, "instrumentation.cpp disagrees on VARIABLE_SLOTS");
+#define NO_SLOT _INSTRUMENT_NO_SLOT
+
+// Variable IDs by slot, or 0 for free slots. Variable IDs are hashes, so
+// per-variable settings are kept by slot; _instrument_slot finds a
+// variable's. Slots are only given out, under slot_lock, and never freed.
+extern "C" uint32_t _instrument_slot_ids[VARIABLE_SLOTS];
+uint32_t _instrument_slot_ids[VARIABLE_SLOTS];
+
+// Guards giving out slots, and reloads of the enable file.
+static std::mutex slot_lock;
+static unsigned slots_used = 0;
+static std::atomic<bool> slots_full{false};
+
+static unsigned claim_slot_locked(unsigned varid);
+
+// Returns a variable's slot, giving it one with the default settings if it
+// has none, or NO_SLOT if every slot is taken. Call it only once the
+// runtime is initialized, so the defaults are set.
+static unsigned claim_slot(unsigned varid) {
+    unsigned slot = _instrument_slot(varid);
+    if (slot != NO_SLOT || slots_full.load(std::memory_order_relaxed)) return slot;
+    std::lock_guard<std::mutex> guard(slot_lock);
+    return claim_slot_locked(varid);
+}
+
+// Sampling thresholds by slot, as trace_record::sample_skip: a store is
+// logged when a uniform 32-bit random number is at least its variable's
+// skip. Zero, the initial value, logs every store until the runtime
+// starts. The inline fast path reads them too, so they are accessed with
+// __atomic builtins.
+extern "C" uint32_t _instrument_sample_skips[VARIABLE_SLOTS];
+uint32_t _instrument_sample_skips[VARIABLE_SLOTS];
+
+// Threshold for variables without a slot, and for new slots.
+extern "C" uint32_t _instrument_default_sample_skip;
+uint32_t _instrument_default_sample_skip = 0;
+
+// Returns the skip threshold that logs a store with probability rate.
+static uint32_t skip_for_rate(double rate) {
+    double skip = (1.0 - rate) * 4294967296.0;
+    return skip >= 4294967295.0 ? 4294967295u : static_cast<uint32_t>(skip);
+}
+
+static uint32_t get_sample_skip(unsigned slot) {
+    if (slot != NO_SLOT) return __atomic_load_n(&_instrument_sample_skips[slot], __ATOMIC_RELAXED);
+    return __atomic_load_n(&_instrument_default_sample_skip, __ATOMIC_RELAXED);
+}
+
+// Sets every variable's sampling rate. Changes-only mode logs every
+// store, so its thresholds stay zero.
+static void init_sample_rates(const trace_config &config) {
+    if (config.changes_only) return;
+    uint32_t skip = skip_for_rate(config.sample_rate);
+    for (uint32_t &sample_skip: _instrument_sample_skips)
+        __atomic_store_n(&sample_skip, skip, __ATOMIC_RELAXED);
+    __atomic_store_n(&_instrument_default_sample_skip, skip, __ATOMIC_RELAXED);
+}
+
+// One bit per slot, set if stores to its variable are ignored. Starts
+// clear, so every variable is enabled until the enable file says
+// otherwise. The inline fast path reads it too, so it is accessed with
+// __atomic builtins, which C code can use.
+extern "C" unsigned long long _instrument_disabled[VARIABLE_SLOTS / 64];
+unsigned long long _instrument_disabled[VARIABLE_SLOTS / 64];
+
+// Whether variables without a slot, and new slots, are ignored.
+static std::atomic<bool> default_disabled{false};
+
+static inline bool is_disabled(unsigned slot) {
+    if (slot != NO_SLOT)
+        return (__atomic_load_n(&_instrument_disabled[slot / 64], __ATOMIC_RELAXED) >> (slot % 64)) & 1;
+    return default_disabled.load(std::memory_order_relaxed);
+}
+
+// Loads the enable file into the bitmap, giving the variables it lists
+// slots. A store racing with a reload sees each variable's old or new
+// setting. Returns the number of variables with slots that are disabled,
+// or -1 if the file cannot be read.
+static long load_enable_file(const std::string &path) {
+    FILE *in = fopen(path.c_str(), "r");
+    if (!in) {
+        perror(("log_usage: cannot open " + path).c_str());
+        return -1;
+    }
+
+    // Read everything first, since a "*" line may come last.
+    bool all_disabled = false;
+    std::vector<std::pair<unsigned, bool>> settings;
+    char line[256];
+    while (fgets(line, sizeof(line), in)) {
+        unsigned varid;
+        int enabled;
+        // Skips the header and anything else that does not parse.
+        if (sscanf(line, " *,%d", &enabled) == 1)
+            all_disabled = enabled == 0;
+        else if (sscanf(line, "%u,%d", &varid, &enabled) == 2)
+            settings.emplace_back(varid, enabled != 0);
+    }
+    fclose(in);
+
+    std::lock_guard<std::mutex> guard(slot_lock);
+    std::vector<uint64_t> words(VARIABLE_SLOTS / 64, all_disabled ? ~uint64_t(0) : 0);
+    for (const auto &setting: settings) {
+        unsigned slot = claim_slot_locked(setting.first);
+        if (slot == NO_SLOT) continue;
+        uint64_t bit = uint64_t(1) << (slot % 64);
+        if (setting.second) words[slot / 64] &= ~bit;
+        else words[slot / 64] |= bit;
+    }
+
+    long count = 0;
+    for (size_t i = 0; i < words.size(); i++) {
+        __atomic_store_n(&_instrument_disabled[i], words[i], __ATOMIC_RELAXED);
+        for (unsigned slot = i * 64; slot < (i + 1) * 64; slot++)
+            if (_instrument_slot_ids[slot] && (words[i] >> (slot % 64)) & 1) count++;
+    }
+    default_disabled.store(all_disabled, std::memory_order_relaxed);
+    return count;
+}
+
+// Identifies a version of the enable file, to notice when it changes.
+struct file_version {
+    dev_t dev = 0;
+    ino_t ino = 0;
+    off_t size = -1;
+    struct timespec mtime = {0, 0};
+
+    bool operator==(const file_version &other) const {
+        return dev == other.dev && ino == other.ino && size == other.size &&
+               mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec;
+    }
+};
+
+static file_version version_of(const std::string &path) {
+    file_version version;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        version.dev = st.st_dev;
+        version.ino = st.st_ino;
+        version.size = st.st_size;
+        version.mtime = st.st_mtim;
+    }
+    return version;
+}
+
+// The enable file's version as last loaded. Only the writer uses it after
+// startup.
+static file_version enable_file_version;
+
+// Loads the enable file at startup.
+static void init_enabled(const trace_config &config) {
+    if (config.enable_file.empty()) return;
+    enable_file_version = version_of(config.enable_file);
+    load_enable_file(config.enable_file);
+}
+
+// Reloads the enable file if it changed since it was last loaded. A file
+// that disappears leaves the bitmap as it was. Only the writer calls this.
+static void poll_enable_file(const trace_config &config) {
+    if (config.enable_file.empty()) return;
+    file_version version = version_of(config.enable_file);
+    if (version == enable_file_version || version.size < 0) return;
+    enable_file_version = version;
+    long count = load_enable_file(config.enable_file);
+    if (count >= 0)
+        std::cerr << "log_usage: reloaded " << config.enable_file << ", " << count << " variables disabled" << std::endl;
+}
+
+// The rewriter's descriptors of the variables in the binary (see
+// instrumentation.cpp), by slot, or nullptr for variables it did not
+// describe. Only variables described in the module log_usage.cpp is
+// linked into are found. Set once, before any thread has a ring.
+static const _instrument_variable *variables[VARIABLE_SLOTS];
+
+extern "C" const char __start_sa4u_variables[] __attribute__((weak));
+extern "C" const char __stop_sa4u_variables[] __attribute__((weak));
+
+static void init_variables() {
+    const char *p = __start_sa4u_variables;
+    while (p && p + sizeof(_instrument_variable) <= __stop_sa4u_variables) {
+        auto *v = reinterpret_cast<const _instrument_variable*>(p);
+        if (v->magic != _INSTRUMENT_VARIABLE_MAGIC || v->record_size < sizeof(*v)) {
+            p += 8;
+            continue;
         }
+        unsigned slot = claim_slot(v->varid);
+        if (slot != NO_SLOT && !variables[slot]) variables[slot] = v;
+        p += (v->record_size + 7) & ~7u;
     }
-    
-    lock.lock();
-    variable_readings[varid].push_back({time(nullptr), val});
-    lock.unlock();
 }
 
-// compute MSE
-static double mse(double a, double b) {
-    return pow(a - b, 2);
+// Returns a descriptor's qualified variable name.
+static const char *variable_name(const _instrument_variable &v) {
+    return reinterpret_cast<const char*>(&v + 1);
 }
 
-static void print_log() {
-    using namespace std;
+// Returns the type tag for a store to a variable. Integers are signed
+// unless the rewriter described the variable as unsigned.
+static inline trace_type variable_type(unsigned slot, int vartype, unsigned long long size) {
+    const _instrument_variable *v = slot != NO_SLOT ? variables[slot] : nullptr;
+    return trace_type_of(vartype == FLOATING_TYPE, size, !v || v->is_signed);
+}
 
-    while (true) {
-        ofstream out("/home/rewriter/log.csv", ofstream::out);
-        out << "variable_id,timestamp,value" << endl;
+// True in changes-only mode. Set once, before any thread has a ring.
+static bool changes_only = false;
 
-        const unordered_map<unsigned, std::vector<std::tuple<time_t, double>>>& vars = get_variable_history();
-        mutex &lock = get_lock();
+// Deadbands by slot for changes-only mode.
+static double deadbands[VARIABLE_SLOTS];
+static double default_deadband = 0.0;
 
-        lock.lock();
-        for (const auto &pair: vars) {
-            for (const auto &reading: pair.second) {
-                out << pair.first << "," << get<0>(reading) << "," << get<1>(reading) << endl;
-            }
+// Loads the deadbands from the configuration and the deadband file.
+static void init_deadbands(const trace_config &config) {
+    changes_only = config.changes_only;
+    default_deadband = config.deadband;
+    for (double &deadband: deadbands)
+        deadband = config.deadband;
+    if (config.deadband_file.empty()) return;
+
+    FILE *in = fopen(config.deadband_file.c_str(), "r");
+    if (!in) {
+        perror(("log_usage: cannot open " + config.deadband_file).c_str());
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), in)) {
+        unsigned varid;
+        double deadband;
+        // Skips the header and anything else that does not parse.
+        if (sscanf(line, "%u,%lf", &varid, &deadband) != 2 || deadband < 0.0) continue;
+        unsigned slot = claim_slot(varid);
+        if (slot != NO_SLOT) deadbands[slot] = deadband;
+    }
+    fclose(in);
+}
+
+// Gives a variable the first free slot from its home, with the default
+// settings, unless it has one. The slot's ID is published last, so a
+// thread that finds the slot sees its settings. Takes slot_lock.
+static unsigned claim_slot_locked(unsigned varid) {
+    if (!varid) return NO_SLOT;
+    unsigned slot = varid & (VARIABLE_SLOTS - 1);
+    for (uint32_t id; (id = _instrument_slot_ids[slot]); slot = (slot + 1) & (VARIABLE_SLOTS - 1))
+        if (id == varid) return slot;
+    if (slots_used == MAX_SLOTS_USED) {
+        if (!slots_full.exchange(true))
+            std::cerr << "log_usage: more than " << MAX_SLOTS_USED
+                      << " variables; the rest get the default settings" << std::endl;
+        return NO_SLOT;
+    }
+    slots_used++;
+
+    __atomic_store_n(&_instrument_sample_skips[slot], __atomic_load_n(&_instrument_default_sample_skip, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    uint64_t bit = uint64_t(1) << (slot % 64);
+    if (default_disabled.load(std::memory_order_relaxed))
+        __atomic_fetch_or(&_instrument_disabled[slot / 64], bit, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_and(&_instrument_disabled[slot / 64], ~bit, __ATOMIC_RELAXED);
+    deadbands[slot] = default_deadband;
+    __atomic_store_n(&_instrument_slot_ids[slot], varid, __ATOMIC_RELEASE);
+    return slot;
+}
+
+// Creates the ring file. Without it, rings stay in memory.
+static void init_persist(const trace_config &config) {
+    if (config.persist_path.empty()) return;
+    int fd = open(config.persist_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(("log_usage: cannot open " + config.persist_path).c_str());
+        return;
+    }
+    size_t size = sizeof(trace_persist_header) + config.persist_threads * trace_persist_region_size(RING_CAPACITY);
+    void *data = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(("log_usage: cannot map " + config.persist_path).c_str());
+        return;
+    }
+
+    // The file starts zeroed, so every region is unclaimed and empty.
+    auto *header = static_cast<trace_persist_header*>(data);
+    memcpy(header->magic, TRACE_PERSIST_MAGIC, sizeof(TRACE_PERSIST_MAGIC));
+    header->version = TRACE_PERSIST_VERSION;
+    header->header_size = sizeof(trace_persist_header);
+    header->ring_capacity = RING_CAPACITY;
+    header->num_regions = config.persist_threads;
+    header->start_wall_ns = trace_start_wall_ns;
+    persist_file = header;
+    publish_calibration();
+}
+
+// Returns the bucket of a histogram value.
+static inline int profile_bucket(uint64_t value) {
+    if (value < PROFILE_SUB_BUCKETS) return value;
+    int shift = 63 - __builtin_clzll(value) - PROFILE_SUB_BUCKET_BITS;
+    return (shift + 1) * PROFILE_SUB_BUCKETS + ((value >> shift) & (PROFILE_SUB_BUCKETS - 1));
+}
+
+// Returns the smallest value in a histogram bucket.
+static uint64_t profile_bucket_low(int bucket) {
+    if (bucket < PROFILE_SUB_BUCKETS) return bucket;
+    int shift = bucket / PROFILE_SUB_BUCKETS - 1;
+    return static_cast<uint64_t>(PROFILE_SUB_BUCKETS + bucket % PROFILE_SUB_BUCKETS) << shift;
+}
+
+// A histogram one thread records into and the writer reads. Only the
+// owning thread stores to it.
+struct latency_histogram {
+    std::atomic<uint64_t> counts[PROFILE_BUCKETS] = {};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+
+    void record(uint64_t value, uint64_t count = 1) {
+        std::atomic<uint64_t> &bucket = counts[profile_bucket(value)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+        sum.store(sum.load(std::memory_order_relaxed) + value * count, std::memory_order_relaxed);
+        if (value > max.load(std::memory_order_relaxed)) max.store(value, std::memory_order_relaxed);
+    }
+};
+
+// A merged copy of latency_histograms.
+struct histogram_totals {
+    uint64_t counts[PROFILE_BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    void add(const latency_histogram &h) {
+        for (int b = 0; b < PROFILE_BUCKETS; b++) {
+            uint64_t n = h.counts[b].load(std::memory_order_relaxed);
+            counts[b] += n;
+            count += n;
         }
-        lock.unlock();
-        sleep(300);
+        sum += h.sum.load(std::memory_order_relaxed);
+        max = std::max(max, h.max.load(std::memory_order_relaxed));
+    }
+
+    void add(const histogram_totals &h) {
+        for (int b = 0; b < PROFILE_BUCKETS; b++)
+            counts[b] += h.counts[b];
+        count += h.count;
+        sum += h.sum;
+        max = std::max(max, h.max);
+    }
+
+    // Returns the smallest value of the bucket holding quantile q.
+    uint64_t quantile(double q) const {
+        uint64_t rank = static_cast<uint64_t>(q * count), seen = 0;
+        for (int b = 0; b < PROFILE_BUCKETS; b++) {
+            seen += counts[b];
+            if (seen > rank) return profile_bucket_low(b);
+        }
+        return max;
+    }
+};
+
+// What log_usage has cost one thread. Profiles are never freed, so the
+// costs of threads that have exited are still reported.
+struct thread_profile {
+    uint32_t tid = 0;
+
+    // Cycles per log_usage call, and per store handed over by the inline
+    // fast path (its flush's cycles split evenly over its stores).
+    latency_histogram call_cycles;
+
+    // Nanoseconds spent waiting for the lock the collector and writer share.
+    latency_histogram lock_wait_ns;
+
+    // Nanoseconds per flush of the trace, for the writer.
+    latency_histogram flush_ns;
+
+    // Calls and cycles per variable, indexed by slot.
+    std::unique_ptr<std::atomic<uint64_t>[]> variable_calls{new std::atomic<uint64_t>[VARIABLE_SLOTS]()};
+    std::unique_ptr<std::atomic<uint64_t>[]> variable_cycles{new std::atomic<uint64_t>[VARIABLE_SLOTS]()};
+
+    thread_profile *next = nullptr;
+};
+
+// True if SA4U_TRACE_PROFILE is on. Set once, before any thread has a ring.
+static bool profiling = false;
+
+// Lock-free stack of every thread's profile.
+static std::atomic<thread_profile*> profile_list{nullptr};
+
+static thread_local thread_profile *current_profile = nullptr;
+
+// Returns the calling thread's profile, creating it on first use.
+static thread_profile &get_thread_profile() {
+    if (!current_profile) {
+        auto *profile = new thread_profile;
+        profile->tid = gettid();
+        profile->next = profile_list.load(std::memory_order_relaxed);
+        while (!profile_list.compare_exchange_weak(profile->next, profile, std::memory_order_release,
+                                                   std::memory_order_relaxed))
+            ;
+        current_profile = profile;
+    }
+    return *current_profile;
+}
+
+// Returns a timestamp for measuring short costs: cycles where there is a
+// TSC, and nanoseconds elsewhere.
+static inline uint64_t profile_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+// Charges cycles spent on stores to a variable to the calling thread.
+static void record_cost(unsigned varid, uint64_t cycles, uint64_t calls = 1) {
+    thread_profile &profile = get_thread_profile();
+    profile.call_cycles.record(cycles / calls, calls);
+    unsigned slot = _instrument_slot(varid);
+    if (slot == NO_SLOT) return;
+    std::atomic<uint64_t> &total_calls = profile.variable_calls[slot];
+    std::atomic<uint64_t> &total_cycles = profile.variable_cycles[slot];
+    total_calls.store(total_calls.load(std::memory_order_relaxed) + calls, std::memory_order_relaxed);
+    total_cycles.store(total_cycles.load(std::memory_order_relaxed) + cycles, std::memory_order_relaxed);
+}
+
+// Takes a lock, recording how long that took when profiling.
+template <typename Lock>
+static void lock_profiled(Lock &lock) {
+    if (!profiling) {
+        lock.lock();
+        return;
     }
+    unsigned long long start = monotonic_ns();
+    lock.lock();
+    get_thread_profile().lock_wait_ns.record(monotonic_ns() - start);
+}
+
+// Sets up everything the hot path reads, on first use.
+static void ensure_runtime() {
+    static bool initialized = [] {
+        init_clock();
+        profiling = get_config().profile;
+        init_variables();
+        init_persist(get_config());
+        init_sample_rates(get_config());
+        init_deadbands(get_config());
+        init_enabled(get_config());
+        return true;
+    }();
+    (void) initialized;
+}
+
+// Returns the next number from the ring's xorshift64 generator.
+static inline uint32_t next_random(trace_ring *ring) {
+    uint64_t x = ring->random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    ring->random_state = x;
+    return static_cast<uint32_t>(x >> 32);
+}
+
+// Allocates a ring for the calling thread and makes it visible to the
+// collector. Returns nullptr, counting a dropped reading, if the thread's
+// ring is already retired.
+static trace_ring *register_ring() {
+    if (ring_retired) {
+        total_dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    static thread_local ring_retirer retirer;
+    ensure_runtime();
+    unsigned long long start = monotonic_ns();
+    trace_ring *ring = new trace_ring;
+    ring->random_state = (start ^ reinterpret_cast<uintptr_t>(ring)) | 1;
+    uint32_t region = persist_file ? persist_file->regions_used.fetch_add(1, std::memory_order_relaxed) : 0;
+    if (persist_file && region < persist_file->num_regions) {
+        ring->region = trace_persist_region_at(persist_file, region);
+        ring->region->tid = gettid();
+        ring->readings = trace_persist_records(ring->region);
+    } else {
+        if (persist_file && region == persist_file->num_regions)
+            std::cerr << "log_usage: ring file is full; new threads' readings will not survive a crash" << std::endl;
+        ring->heap_readings.reset(new trace_record[RING_CAPACITY]);
+        ring->readings = ring->heap_readings.get();
+    }
+    if (changes_only) {
+        ring->last_values.reset(new last_value[LAST_VALUE_SLOTS]);
+        for (int i = 0; i < LAST_VALUE_SLOTS; i++) {
+            ring->last_values[i].varid = NO_VARIABLE;
+            ring->last_values[i].repeats = 0;
+        }
+    }
+
+    ring->next = ring_list.load(std::memory_order_relaxed);
+    while (!ring_list.compare_exchange_weak(ring->next, ring, std::memory_order_release, std::memory_order_relaxed))
+        ;
+
+    ring->stall_ns.store(monotonic_ns() - start, std::memory_order_relaxed);
+    retirer.ring = ring;
+    current_ring = ring;
+    return ring;
+}
+
+// Appends a reading to the calling thread's ring.
+// Never blocks: if the collector has fallen behind, the reading is dropped.
+static inline void push_reading(trace_ring *ring, unsigned varid, trace_type type, uint64_t bits,
+                                uint32_t sample_skip, uint64_t timestamp, uint8_t flags = 0, uint32_t repeats = 0) {
+    unsigned long long head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->cached_tail == RING_CAPACITY) {
+        unsigned long long start = monotonic_ns();
+        ring->cached_tail = ring->tail.load(std::memory_order_acquire);
+        bool full = head - ring->cached_tail == RING_CAPACITY;
+        if (full)
+            ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        ring->stall_ns.store(ring->stall_ns.load(std::memory_order_relaxed) + monotonic_ns() - start,
+                             std::memory_order_relaxed);
+        if (full) return;
+    }
+
+    trace_record &r = ring->readings[head & (RING_CAPACITY - 1)];
+    r.varid = varid;
+    r.type = type;
+    r.flags = flags;
+    r.reserved = 0;
+    r.sample_skip = sample_skip;
+    r.repeats = repeats;
+    r.timestamp = timestamp;
+    r.bits = bits;
+    if (ring->region) r.reserved = trace_persist_check(r, head);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+// Reports a slot's run of repeated stores, if it has one.
+static void flush_run(trace_ring *ring, last_value &slot, uint64_t timestamp) {
+    if (slot.varid == NO_VARIABLE || slot.repeats == 0) return;
+    push_reading(ring, slot.varid, slot.type, slot.bits, 0, timestamp, TRACE_FLAG_RUN, slot.repeats);
+    slot.repeats = 0;
+}
+
+// Reports every run in the ring's cache. Called by the owning thread.
+static void flush_runs(trace_ring *ring) {
+    if (!ring->last_values) return;
+    uint64_t now = read_clock();
+    for (int i = 0; i < LAST_VALUE_SLOTS; i++)
+        flush_run(ring, ring->last_values[i], now);
+}
+
+// Returns true if a store is within the variable's deadband of a value.
+static inline bool within_deadband(unsigned varid, trace_type type, uint64_t bits, const last_value &slot) {
+    unsigned variable_slot = _instrument_slot(varid);
+    double deadband = variable_slot != NO_SLOT ? deadbands[variable_slot] : default_deadband;
+    return deadband > 0.0 &&
+           fabs(trace_decode(type, bits) - trace_decode(slot.type, slot.bits)) <= deadband;
+}
+
+// Logs a store that sampling has let through, unless it repeats the last
+// value logged for the variable in changes-only mode. clock is the raw
+// time of the store, or 0 to read it now.
+static inline void log_reading(trace_ring *ring, unsigned varid, trace_type type, uint64_t bits,
+                               uint32_t sample_skip, uint64_t clock) {
+    if (changes_only) {
+        // Count repeats of the last value this thread logged for the
+        // variable. Anything else ends the slot's run: the store changed
+        // the value, or evicted another variable from the slot.
+        last_value &slot = ring->last_values[varid & (LAST_VALUE_SLOTS - 1)];
+        if (slot.varid == varid && slot.repeats != UINT32_MAX &&
+            (slot.bits == bits || within_deadband(varid, type, bits, slot))) {
+            slot.repeats++;
+            return;
+        }
+        uint64_t now = clock ? clock : read_clock();
+        flush_run(ring, slot, now);
+        slot.varid = varid;
+        slot.bits = bits;
+        slot.type = type;
+        push_reading(ring, varid, type, bits, sample_skip, now);
+        return;
+    }
+
+    push_reading(ring, varid, type, bits, sample_skip, clock ? clock : read_clock());
+}
+
+static inline void log_store(int vartype, unsigned varid, void *data, unsigned long long size) {
+    trace_ring *ring = current_ring;
+    if (!ring && !(ring = register_ring())) return;
+
+    unsigned slot = claim_slot(varid);
+    if (__builtin_expect(is_disabled(slot), 0)) return;
+
+    uint32_t sample_skip = 0;
+    if (!changes_only) {
+        sample_skip = get_sample_skip(slot);
+        if (next_random(ring) < sample_skip) return;
+    }
+
+    if (!data) return;
+
+    // Keep the raw bits; the writer decodes them.
+    trace_type type = variable_type(slot, vartype, size);
+    uint64_t bits = 0;
+    if (type != TRACE_UNKNOWN)
+        memcpy(&bits, data, size);
+    log_reading(ring, varid, type, bits, sample_skip, 0);
+}
+
+extern "C" void log_usage(int vartype, unsigned varid, void *data, unsigned long long size) {
+    if (__builtin_expect(!profiling, 1)) {
+        log_store(vartype, varid, data, size);
+        return;
+    }
+    uint64_t start = profile_clock();
+    log_store(vartype, varid, data, size);
+    record_cost(varid, profile_clock() - start);
+}
+
+extern "C" {
+__thread _instrument_buffer _instrument_tls = {_INSTRUMENT_BUFFER_ENTRIES - 1, 0, 0, {}};
+}
+
+// Logs the stores in a thread's fast path buffer and empties it. Stores
+// the fast path did not stamp with the TSC are stamped now.
+static void flush_buffer(_instrument_buffer &buffer) {
+    unsigned first = 0;
+    if (!buffer.primed) {
+        // count started one short of full, so the only real store is the
+        // one that filled the buffer, if any.
+        if (buffer.count != _INSTRUMENT_BUFFER_ENTRIES) return;
+        first = buffer.count - 1;
+    }
+
+    trace_ring *ring = current_ring;
+    if (!ring && !(ring = register_ring())) {
+        total_dropped.fetch_add(buffer.count - first, std::memory_order_relaxed);
+        buffer.count = buffer.primed ? 0 : _INSTRUMENT_BUFFER_ENTRIES - 1;
+        return;
+    }
+    uint64_t now = 0;
+    for (unsigned i = first; i < buffer.count; i++) {
+        const _instrument_entry &entry = buffer.entries[i];
+        unsigned slot = claim_slot(entry.varid);
+        if (is_disabled(slot)) continue;
+        uint32_t sample_skip = entry.sample_skip;
+        if (!buffer.primed) {
+            // The fast path only samples once the buffer is primed.
+            sample_skip = changes_only ? 0 : get_sample_skip(slot);
+            if (next_random(ring) < sample_skip) continue;
+        }
+        trace_type type = variable_type(slot, entry.vartype, entry.size);
+        uint64_t clock = entry.clock;
+        if (!clock) clock = now ? now : (now = read_clock());
+        log_reading(ring, entry.varid, type, type == TRACE_UNKNOWN ? 0 : entry.bits, sample_skip, clock);
+    }
+    buffer.count = 0;
+    if (!buffer.primed) {
+        buffer.random_state = (static_cast<uint64_t>(next_random(ring)) << 32 | next_random(ring)) | 1;
+        buffer.primed = 1;
+    }
+}
+
+// Called by the inline fast path when the calling thread's buffer fills.
+extern "C" void log_usage_flush_buffer() {
+    if (__builtin_expect(!profiling, 1)) {
+        flush_buffer(_instrument_tls);
+        return;
+    }
+    _instrument_buffer &buffer = _instrument_tls;
+    unsigned count = buffer.count;
+    unsigned first = buffer.primed ? 0 : count - 1;
+    uint64_t start = profile_clock();
+    flush_buffer(buffer);
+    uint64_t cycles = profile_clock() - start;
+    if (buffer.count != 0 || first >= count) return;
+
+    // Split the flush evenly over its stores.
+    uint64_t per_store = cycles / (count - first);
+    for (unsigned i = first; i < count; i++)
+        record_cost(buffer.entries[i].varid, per_store);
+}
+
+// The live stream readings are published to, or nullptr. Set before the
+// collector starts, and only the thread draining the rings publishes.
+static trace_shm_header *shm_stream = nullptr;
+static uint32_t shm_pid;
+
+// Maps the stream named by SA4U_TRACE_SHM, creating it if needed.
+static void open_shm_stream(const trace_config &config) {
+    if (config.shm_name.empty()) return;
+    std::string error;
+    shm_stream = trace_shm_attach(config.shm_name, config.shm_slots, true, error);
+    if (!shm_stream)
+        std::cerr << "log_usage: not publishing to shared memory: " << error << std::endl;
+    shm_pid = getpid();
+}
+
+// Moves everything buffered in the per-thread rings into the pending readings.
+// Frees rings whose threads have exited once they are empty.
+// Only the collector thread calls this.
+static void drain_rings() {
+    auto &pending = get_pending_readings();
+    auto &updates = get_variables_to_updates();
+    auto &stats = get_variable_stats();
+    auto &fits = get_variables_to_fits();
+    bool stats_mode = get_config().stats;
+    bool fit_mode = get_config().fit;
+    std::mutex &lock = get_lock();
+    unsigned long long dropped = 0, stall_ns = 0;
+
+    // Pair this pass's samples with the measurements as of now. The
+    // simulator writes them without synchronization, so this may mix two
+    // of its steps, but it is never more than a drain period stale.
+    std::array<double, NUM_MEASUREMENTS> measurements = get_varinfo_measurements();
+
+    lock_profiled(lock);
+    trace_ring *prev = nullptr;
+    for (trace_ring *ring = ring_list.load(std::memory_order_acquire); ring;) {
+        bool retired = ring->retired.load(std::memory_order_acquire);
+        unsigned long long tail = ring->tail.load(std::memory_order_relaxed);
+        unsigned long long head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; tail++) {
+            trace_record r = ring->readings[tail & (RING_CAPACITY - 1)];
+            r.reserved = 0;
+            r.timestamp = to_trace_ns(r.timestamp);
+            if (shm_stream) {
+                trace_record live = r;
+                live.timestamp += trace_start_ns;
+                trace_shm_publish(shm_stream, shm_pid, live);
+            }
+            double weight = 1.0 / trace_sample_rate(r.sample_skip);
+            if (r.flags & TRACE_FLAG_RUN) weight *= r.repeats;
+            updates[r.varid] += weight;
+            if (fit_mode)
+                update_fit(fits[r.varid], trace_decode(r.type, r.bits), weight, measurements);
+            if (stats_mode)
+                update_stats(stats[r.varid], trace_decode(r.type, r.bits), weight, measurements);
+            else
+                append_record(pending[r.varid], r);
+        }
+        ring->tail.store(tail, std::memory_order_release);
+        if (ring->region) ring->region->committed.store(tail, std::memory_order_release);
+
+        trace_ring *next = ring->next;
+        if (!retired) {
+            dropped += ring->dropped.load(std::memory_order_relaxed);
+            stall_ns += ring->stall_ns.load(std::memory_order_relaxed);
+            prev = ring;
+            ring = next;
+            continue;
+        }
+
+        // Unlink the ring. A thread may have pushed a new ring in front of
+        // it since we loaded the list head, so fall back to searching.
+        trace_ring *expected = ring;
+        if (prev) {
+            prev->next = next;
+        } else if (!ring_list.compare_exchange_strong(expected, next, std::memory_order_acquire)) {
+            trace_ring *p = expected;
+            while (p->next != ring) p = p->next;
+            p->next = next;
+        }
+        total_dropped.fetch_add(ring->dropped.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        total_stall_ns.fetch_add(ring->stall_ns.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        delete ring;
+        ring = next;
+    }
+    lock.unlock();
+
+    live_dropped.store(dropped, std::memory_order_relaxed);
+    live_stall_ns.store(stall_ns, std::memory_order_relaxed);
+}
+
+// Returns the number of readings dropped because a ring was full.
+extern "C" unsigned long long log_usage_dropped() {
+    return total_dropped.load(std::memory_order_relaxed) + live_dropped.load(std::memory_order_relaxed);
+}
+
+// Returns the total nanoseconds instrumented threads spent off the fast path
+// of log_usage. It stays flat across flushes because stores never wait on
+// the writer.
+extern "C" unsigned long long log_usage_stall_ns() {
+    return total_stall_ns.load(std::memory_order_relaxed) + live_stall_ns.load(std::memory_order_relaxed);
+}
+
+// Destination for the formatted trace. Only the writer thread uses a sink.
+class trace_sink {
+ public:
+    virtual ~trace_sink() {}
+
+    // Queues bytes to be appended to the trace.
+    virtual void append(const char *data, size_t size) = 0;
+
+    // Hands everything queued so far to the kernel.
+    virtual void flush() = 0;
+
+    // Flushes and closes the trace.
+    virtual void finish() = 0;
+};
+
+// Writes through a buffer with write(2).
+class write_sink : public trace_sink {
+ public:
+    explicit write_sink(int fd) : fd(fd) { buffer.reserve(WRITE_BUFFER_SIZE); }
+
+    void append(const char *data, size_t size) override {
+        buffer.append(data, size);
+        if (buffer.size() >= WRITE_BUFFER_SIZE) flush();
+    }
+
+    void flush() override {
+        write_fully(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    void finish() override {
+        flush();
+        close(fd);
+    }
+
+ private:
+    void write_fully(const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t written = write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                perror("log_usage: write");
+                return;
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    int fd;
+    std::string buffer;
+};
+
+// Writes whole aligned blocks with O_DIRECT, bypassing the page cache.
+// A partial last block stays buffered until the next flush, and is padded
+// and then truncated away when the trace is finished.
+class direct_sink : public trace_sink {
+ public:
+    direct_sink(int fd, char *buffer) : fd(fd), buffer(buffer), used(0), offset(0), failed(false) {}
+
+    ~direct_sink() override { free(buffer); }
+
+    void append(const char *data, size_t size) override {
+        while (size > 0 && !failed) {
+            size_t n = std::min(size, static_cast<size_t>(WRITE_BUFFER_SIZE) - used);
+            memcpy(buffer + used, data, n);
+            used += n;
+            data += n;
+            size -= n;
+            if (used == WRITE_BUFFER_SIZE) flush();
+        }
+    }
+
+    void flush() override {
+        size_t whole = used - used % DIRECT_IO_ALIGNMENT;
+        if (failed || whole == 0 || !write_fully(whole)) return;
+        memmove(buffer, buffer + whole, used - whole);
+        used -= whole;
+    }
+
+    void finish() override {
+        flush();
+        if (!failed && used > 0) {
+            size_t padded = (used + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+            memset(buffer + used, 0, padded - used);
+            if (write_fully(padded) && ftruncate(fd, offset - padded + used) != 0)
+                perror("log_usage: ftruncate");
+        }
+        close(fd);
+    }
+
+ private:
+    bool write_fully(size_t size) {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t written = pwrite(fd, buffer + done, size - done, offset + done);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                perror("log_usage: pwrite");
+                failed = true;
+                return false;
+            }
+            done += written;
+        }
+        offset += size;
+        return true;
+    }
+
+    int fd;
+    char *buffer;
+    size_t used;
+    off_t offset;
+
+    // Set once a write fails. Nothing more is written, since the trace
+    // would have a hole.
+    bool failed;
+};
+
+#ifdef SA4U_TRACE_URING
+// Submits each flush as an asynchronous io_uring write. The writer fills
+// one buffer while the previous one is in flight.
+class uring_sink : public trace_sink {
+ public:
+    uring_sink(int fd, struct io_uring ring) : fd(fd), ring(ring), offset(0), current(0), in_flight(false) {}
+
+    void append(const char *data, size_t size) override {
+        buffers[current].append(data, size);
+        if (buffers[current].size() >= WRITE_BUFFER_SIZE) flush();
+    }
+
+    void flush() override {
+        std::string &buffer = buffers[current];
+        if (buffer.empty()) return;
+        reap();
+
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_write(sqe, fd, buffer.data(), buffer.size(), offset);
+        io_uring_submit(&ring);
+        submitted = buffer.size();
+        in_flight = true;
+
+        current ^= 1;
+        buffers[current].clear();
+    }
+
+    void finish() override {
+        flush();
+        reap();
+        io_uring_queue_exit(&ring);
+        close(fd);
+    }
+
+ private:
+    // Waits for the in-flight write, finishing it synchronously if it was short.
+    void reap() {
+        if (!in_flight) return;
+        in_flight = false;
+
+        struct io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(&ring, &cqe);
+        size_t written = 0;
+        if (ret == 0) {
+            if (cqe->res < 0) errno = -cqe->res;
+            else written = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+        } else {
+            errno = -ret;
+        }
+
+        const std::string &buffer = buffers[current ^ 1];
+        while (written < submitted) {
+            ssize_t n = pwrite(fd, buffer.data() + written, submitted - written, offset + written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("log_usage: io_uring write");
+                break;
+            }
+            written += n;
+        }
+        offset += submitted;
+    }
+
+    int fd;
+    struct io_uring ring;
+    off_t offset;
+    std::string buffers[2];
+    int current;
+    size_t submitted;
+    bool in_flight;
+};
+#endif
+
+// Truncates the trace file and opens a sink for the configured backend.
+// Returns nullptr if the file cannot be opened.
+static std::unique_ptr<trace_sink> open_sink(const trace_config &config) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    if (config.backend == "direct") {
+        void *buffer;
+        if (posix_memalign(&buffer, DIRECT_IO_ALIGNMENT, WRITE_BUFFER_SIZE) != 0) return nullptr;
+        int fd = open(config.path.c_str(), flags | O_DIRECT, 0644);
+        if (fd >= 0) return std::make_unique<direct_sink>(fd, static_cast<char*>(buffer));
+        perror("log_usage: O_DIRECT unavailable");
+        free(buffer);
+    }
+
+#ifdef SA4U_TRACE_URING
+    if (config.backend == "uring") {
+        struct io_uring ring;
+        int ret = io_uring_queue_init(4, &ring, 0);
+        int fd = ret == 0 ? open(config.path.c_str(), flags, 0644) : -1;
+        if (fd >= 0) return std::make_unique<uring_sink>(fd, ring);
+        if (ret == 0) io_uring_queue_exit(&ring);
+        std::cerr << "log_usage: io_uring unavailable, using write(2)" << std::endl;
+    }
+#endif
+
+    int fd = open(config.path.c_str(), flags | O_APPEND, 0644);
+    if (fd < 0) return nullptr;
+    return std::make_unique<write_sink>(fd);
+}
+
+// Set when the trace is shutting down; the collector and writer then exit.
+static std::atomic<bool> stopping{false};
+
+// Termination signal caught by signal_handler, or 0.
+static volatile sig_atomic_t pending_signal = 0;
+
+// Wakes the writer when stopping or a signal arrives. Used with get_lock().
+static std::condition_variable& get_writer_wakeup() {
+    static auto *wakeup = new std::condition_variable;
+    return *wakeup;
+}
+
+static std::thread *collector_thread;
+static std::thread *writer_thread;
+
+// A variable registered for polling: one object's copy of it.
+struct polled_variable {
+    const void *address;
+    unsigned varid;
+    trace_type type;
+    unsigned size;
+};
+
+// Variables registered for polling, and the poller thread, once started.
+// Guarded by the lock returned by get_poll_lock().
+struct poll_registry {
+    std::vector<polled_variable> variables;
+    std::unordered_map<const void*, std::vector<unsigned>> addresses_to_ids;
+    std::thread *poller = nullptr;
+    bool full = false;
+};
+
+static std::mutex& get_poll_lock() {
+    static auto *lock = new std::mutex;
+    return *lock;
+}
+
+static poll_registry& get_poll_registry() {
+    static auto *registry = new poll_registry;
+    return *registry;
+}
+
+// Copies each variable's current value into bits. Reads go through
+// process_vm_readv, so an address whose object has been unmapped fails
+// rather than crashing; such variables are set in unreadable.
+static void read_polled(const std::vector<polled_variable> &variables, std::vector<uint64_t> &bits,
+                        std::vector<bool> &unreadable) {
+    static bool direct = false;
+    bits.assign(variables.size(), 0);
+    unreadable.assign(variables.size(), false);
+    if (direct) {
+        for (size_t i = 0; i < variables.size(); i++)
+            memcpy(&bits[i], variables[i].address, variables[i].size);
+        return;
+    }
+
+    size_t start = 0;
+    while (start < variables.size()) {
+        struct iovec local[POLL_BATCH], remote[POLL_BATCH];
+        size_t n = std::min(variables.size() - start, static_cast<size_t>(POLL_BATCH));
+        for (size_t i = 0; i < n; i++) {
+            local[i] = {&bits[start + i], variables[start + i].size};
+            remote[i] = {const_cast<void*>(variables[start + i].address), variables[start + i].size};
+        }
+        ssize_t copied = process_vm_readv(getpid(), local, n, remote, n, 0);
+        if (copied < 0 && (errno == ENOSYS || errno == EPERM)) {
+            std::cerr << "log_usage: process_vm_readv is unavailable; polling reads variables directly" << std::endl;
+            direct = true;
+            read_polled(variables, bits, unreadable);
+            return;
+        }
+
+        // Reads stop at the first address that fails. Skip past it.
+        size_t done = 0;
+        for (size_t bytes = std::max<ssize_t>(copied, 0); done < n && bytes >= variables[start + done].size; done++)
+            bytes -= variables[start + done].size;
+        if (done < n) unreadable[start + done++] = true;
+        start += done;
+    }
+}
+
+// Snapshots every registered variable at config.poll_hz, logging the
+// snapshot through the poller's own ring with one timestamp per round.
+// Variables that can no longer be read are dropped from the registry.
+static void poll_variables() {
+    const trace_config &config = get_config();
+    trace_ring *ring = register_ring();
+    auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(1.0 / config.poll_hz));
+    auto next = std::chrono::steady_clock::now();
+    std::vector<polled_variable> variables;
+    std::vector<uint64_t> bits;
+    std::vector<bool> unreadable;
+
+    while (!stopping.load(std::memory_order_acquire)) {
+        std::mutex &lock = get_poll_lock();
+        lock.lock();
+        variables = get_poll_registry().variables;
+        lock.unlock();
+
+        read_polled(variables, bits, unreadable);
+        uint64_t now = read_clock();
+        size_t dropped = 0;
+        for (size_t i = 0; i < variables.size(); i++) {
+            if (unreadable[i]) {
+                dropped++;
+                continue;
+            }
+            if (!is_disabled(_instrument_slot(variables[i].varid)))
+                log_reading(ring, variables[i].varid, variables[i].type, bits[i], 0, now);
+        }
+
+        if (dropped) {
+            lock.lock();
+            poll_registry &registry = get_poll_registry();
+            for (size_t i = 0; i < variables.size(); i++) {
+                if (!unreadable[i]) continue;
+                auto it = registry.addresses_to_ids.find(variables[i].address);
+                if (it != registry.addresses_to_ids.end()) {
+                    auto &ids = it->second;
+                    ids.erase(std::remove(ids.begin(), ids.end(), variables[i].varid), ids.end());
+                    if (ids.empty()) registry.addresses_to_ids.erase(it);
+                }
+                registry.variables.erase(
+                    std::remove_if(registry.variables.begin(), registry.variables.end(), [&](const polled_variable &v) {
+                        return v.address == variables[i].address && v.varid == variables[i].varid;
+                    }), registry.variables.end());
+            }
+            lock.unlock();
+        }
+
+        // Skip rounds that were missed rather than running them late.
+        next += period;
+        auto now_steady = std::chrono::steady_clock::now();
+        if (next < now_steady) next = now_steady;
+        std::this_thread::sleep_until(next);
+    }
+}
+
+// Registers an object's copy of a variable for polling, and starts the
+// poller on the first registration. Called by code the rewriter
+// instrumented with --poll when a store site stores to a different object
+// than it did last.
+extern "C" void log_usage_register(int vartype, unsigned varid, const volatile void *address,
+                                   unsigned long long size) {
+    ensure_runtime();
+    trace_type type = variable_type(claim_slot(varid), vartype, size);
+    if (type == TRACE_UNKNOWN) return;
+
+    std::lock_guard<std::mutex> guard(get_poll_lock());
+    poll_registry &registry = get_poll_registry();
+    std::vector<unsigned> &ids = registry.addresses_to_ids[const_cast<const void*>(address)];
+    if (std::find(ids.begin(), ids.end(), varid) != ids.end()) return;
+    if (registry.variables.size() >= MAX_POLLED_VARIABLES) {
+        if (ids.empty()) registry.addresses_to_ids.erase(const_cast<const void*>(address));
+        if (!registry.full)
+            std::cerr << "log_usage: more than " << MAX_POLLED_VARIABLES << " variables registered for polling; "
+                      << "ignoring the rest" << std::endl;
+        registry.full = true;
+        return;
+    }
+    ids.push_back(varid);
+    registry.variables.push_back({const_cast<const void*>(address), varid, type, static_cast<unsigned>(size)});
+    if (!registry.poller && !stopping.load(std::memory_order_acquire))
+        registry.poller = new std::thread(poll_variables);
+}
+
+// Re-targets each variable's sampling rate so that it logs about
+// config.target_rate samples per second, from the number of updates
+// estimated since the last call. A variable that logged nothing doubles
+// its rate so that a rate that got too low can recover.
+static void adapt_sample_rates(const trace_config &config, double elapsed_s) {
+    // Never destroyed: the collector may still be running when exit()
+    // runs static destructors.
+    static auto *previous_updates = new std::unordered_map<unsigned, double>;
+    const auto &updates = get_variables_to_updates();
+
+    for (const auto &pair: updates) {
+        unsigned slot = _instrument_slot(pair.first);
+        if (slot == NO_SLOT) continue;
+        double &previous = (*previous_updates)[pair.first];
+        double rate = trace_sample_rate(get_sample_skip(slot));
+        double updates_per_s = (pair.second - previous) / elapsed_s;
+        previous = pair.second;
+
+        if (updates_per_s > 0.0) rate = config.target_rate / updates_per_s;
+        else rate *= 2.0;
+        rate = std::min(1.0, std::max(MIN_SAMPLE_RATE, rate));
+        __atomic_store_n(&_instrument_sample_skips[slot], skip_for_rate(rate), __ATOMIC_RELAXED);
+    }
+}
+
+static void collect_readings() {
+    const trace_config &config = get_config();
+    unsigned long long last_adapt = monotonic_ns();
+    unsigned long long last_resync = last_adapt;
+
+    while (!stopping.load(std::memory_order_acquire)) {
+        drain_rings();
+
+        // Drained readings were converted with the old calibration, and
+        // readings still in the rings are close enough to it that the new
+        // one converts them just as well.
+        unsigned long long now = monotonic_ns();
+        if (now - last_resync >= CLOCK_RESYNC_MS * 1000000ull) {
+            resync_clock();
+            last_resync = now;
+        }
+
+        if (config.target_rate > 0.0 && !config.changes_only && now - last_adapt >= ADAPT_PERIOD_MS * 1000000ull) {
+            adapt_sample_rates(config, (now - last_adapt) / 1e9);
+            last_adapt = now;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_PERIOD_MS));
+    }
+}
+
+// Appends the readings retired by one flush to the trace as CSV, oldest
+// first, so that trace_merge can stream the trace.
+static size_t write_csv(trace_sink &sink, const variable_records &readings) {
+    static auto *sorted = new std::vector<const trace_record*>;
+    sorted->clear();
+    for (const auto &pair: readings) {
+        for (const record_chunk *chunk = pair.second.head; chunk; chunk = chunk->next) {
+            for (unsigned i = 0; i < chunk->used; i++)
+                sorted->push_back(&chunk->records[i]);
+        }
+    }
+    std::stable_sort(sorted->begin(), sorted->end(), [](const trace_record *a, const trace_record *b) {
+        return a->timestamp < b->timestamp;
+    });
+
+    char line[96];
+    for (const trace_record *r: *sorted) {
+        int n = snprintf(line, sizeof(line), "%u,%lld,%g,%g,%u\n", r->varid, static_cast<long long>(r->timestamp),
+                         trace_decode(r->type, r->bits), trace_sample_rate(r->sample_skip), r->repeats);
+        sink.append(line, n);
+    }
+    sink.flush();
+    return sorted->size();
+}
+
+// Appends the readings retired by one flush to the trace as one segment,
+// compressing each variable's records if asked to.
+static size_t write_binary(trace_sink &sink, const variable_records &readings, bool compress) {
+    trace_segment_header header;
+    header.magic = TRACE_SEGMENT_MAGIC;
+    header.num_variables = readings.size();
+    header.num_records = 0;
+    for (const auto &pair: readings)
+        header.num_records += pair.second.count;
+    if (header.num_records == 0) return 0;
+    header.encoding = compress ? TRACE_ENCODING_GORILLA : TRACE_ENCODING_RAW;
+    header.reserved = 0;
+    header.data_size = header.num_records * sizeof(trace_record);
+
+    // Blocks are encoded up front, since the index needs their sizes.
+    static auto *blocks = new std::string;
+    std::vector<trace_index_entry> index;
+    index.reserve(readings.size());
+    blocks->clear();
+    uint64_t first = 0;
+    for (const auto &pair: readings) {
+        trace_index_entry entry;
+        entry.varid = pair.first;
+        entry.block_size = 0;
+        entry.first_record = first;
+        entry.num_records = pair.second.count;
+        first += entry.num_records;
+        if (compress) {
+            entry.block_offset = blocks->size();
+            trace_gorilla_encoder encoder(*blocks);
+            for (const record_chunk *chunk = pair.second.head; chunk; chunk = chunk->next) {
+                for (unsigned i = 0; i < chunk->used; i++)
+                    encoder.add(chunk->records[i]);
+            }
+            encoder.finish();
+            entry.block_size = blocks->size() - entry.block_offset;
+        }
+        index.push_back(entry);
+    }
+    if (compress) {
+        // Keep the next segment 8-byte aligned.
+        blocks->resize((blocks->size() + 7) & ~static_cast<size_t>(7), '\0');
+        header.data_size = blocks->size();
+    }
+
+    sink.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    sink.append(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(trace_index_entry));
+    if (compress) {
+        sink.append(blocks->data(), blocks->size());
+    } else {
+        for (const auto &pair: readings) {
+            for (const record_chunk *chunk = pair.second.head; chunk; chunk = chunk->next)
+                sink.append(reinterpret_cast<const char*>(chunk->records), chunk->used * sizeof(trace_record));
+        }
+    }
+    sink.flush();
+    return header.num_records;
+}
+
+// Writes the header that starts a trace.
+static void write_header(trace_sink &sink, const trace_config &config) {
+    if (!config.binary) {
+        const char header[] = "variable_id,timestamp_ns,value,sample_rate,repeats\n";
+        sink.append(header, strlen(header));
+        return;
+    }
+
+    trace_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_FORMAT_VERSION;
+    header.header_size = sizeof(header);
+    header.start_wall_ns = trace_start_wall_ns;
+    sink.append(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+// Memory a variable has needed in the arena.
+struct variable_footprint {
+    unsigned long long records = 0;     // records logged since startup
+    unsigned long long chunks = 0;      // chunks held during the last flush
+    unsigned long long peak_chunks = 0; // most chunks held by one flush
+};
+
+// Folds one flush into the per-variable footprints and rewrites the report
+// at <trace path>.memory.csv.
+static void report_footprint(const trace_config &config, const variable_records &readings,
+                             std::unordered_map<unsigned, variable_footprint> &footprints) {
+    for (auto &pair: footprints)
+        pair.second.chunks = 0;
+    for (const auto &pair: readings) {
+        variable_footprint &f = footprints[pair.first];
+        f.records += pair.second.count;
+        f.chunks = pair.second.chunks;
+        f.peak_chunks = std::max(f.peak_chunks, f.chunks);
+    }
+
+    std::string path = config.path + ".memory.csv";
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) return;
+    fprintf(out, "variable_id,records,bytes,peak_bytes\n");
+    for (const auto &pair: footprints) {
+        fprintf(out, "%u,%llu,%llu,%llu\n", pair.first, pair.second.records,
+                pair.second.chunks * sizeof(record_chunk), pair.second.peak_chunks * sizeof(record_chunk));
+    }
+    fclose(out);
+}
+
+// Returns the names of the variables the binary describes, and of the
+// rest from the name,id CSV the rewriter writes. Names may contain commas,
+// so the ID is whatever follows the last one.
+static std::unordered_map<unsigned, std::string> load_variable_names(const std::string &path) {
+    std::unordered_map<unsigned, std::string> names;
+    for (const _instrument_variable *v: variables) {
+        if (v) names[v->varid] = variable_name(*v);
+    }
+    FILE *in = path.empty() ? nullptr : fopen(path.c_str(), "r");
+    if (!in) return names;
+    char line[1024];
+    while (fgets(line, sizeof(line), in)) {
+        char *comma = strrchr(line, ',');
+        if (!comma) continue;
+        char *end;
+        unsigned long id = strtoul(comma + 1, &end, 10);
+        if (end == comma + 1) continue;
+        names.emplace(id, std::string(line, comma));
+    }
+    fclose(in);
+    return names;
+}
+
+// Writes one line of the profile report: a histogram's summary, then its
+// nonempty buckets as space-separated lowest value:count pairs.
+static void print_profile_line(FILE *out, const char *metric, const std::string &thread, const histogram_totals &h) {
+    fprintf(out, "%s,%s,%llu,%.1f,%llu,%llu,%llu,%llu,%llu,", metric, thread.c_str(),
+            static_cast<unsigned long long>(h.count), static_cast<double>(h.sum) / h.count,
+            static_cast<unsigned long long>(h.quantile(0.5)), static_cast<unsigned long long>(h.quantile(0.9)),
+            static_cast<unsigned long long>(h.quantile(0.99)), static_cast<unsigned long long>(h.quantile(0.999)),
+            static_cast<unsigned long long>(h.max));
+    const char *sep = "";
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        if (!h.counts[b]) continue;
+        fprintf(out, "%s%llu:%llu", sep, static_cast<unsigned long long>(profile_bucket_low(b)),
+                static_cast<unsigned long long>(h.counts[b]));
+        sep = " ";
+    }
+    fprintf(out, "\n");
+}
+
+// Merges every thread's profile and rewrites <trace path>.profile.csv,
+// with a line per metric and thread and a merged "all" line per metric,
+// and <trace path>.profile_variables.csv, costliest variables first.
+static void report_profile(const trace_config &config) {
+    struct metric {
+        const char *name;
+        latency_histogram thread_profile::*histogram;
+    };
+    static const metric metrics[] = {
+        {"call_cycles", &thread_profile::call_cycles},
+        {"lock_wait_ns", &thread_profile::lock_wait_ns},
+        {"flush_ns", &thread_profile::flush_ns},
+    };
+
+    std::string path = config.path + ".profile.csv";
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) return;
+    fprintf(out, "metric,thread,count,mean,p50,p90,p99,p999,max,histogram\n");
+    auto *one = new histogram_totals, *all = new histogram_totals;
+    for (const metric &m: metrics) {
+        *all = histogram_totals();
+        for (thread_profile *p = profile_list.load(std::memory_order_acquire); p; p = p->next) {
+            *one = histogram_totals();
+            one->add(p->*m.histogram);
+            if (!one->count) continue;
+            all->add(*one);
+            print_profile_line(out, m.name, std::to_string(p->tid), *one);
+        }
+        if (all->count) print_profile_line(out, m.name, "all", *all);
+    }
+    delete one;
+    delete all;
+    fclose(out);
+
+    struct variable_cost {
+        unsigned varid;
+        uint64_t calls;
+        uint64_t cycles;
+    };
+    std::vector<variable_cost> costs;
+    uint64_t total_cycles = 0;
+    for (unsigned slot = 0; slot < VARIABLE_SLOTS; slot++) {
+        variable_cost cost = {__atomic_load_n(&_instrument_slot_ids[slot], __ATOMIC_ACQUIRE), 0, 0};
+        if (!cost.varid) continue;
+        for (thread_profile *p = profile_list.load(std::memory_order_acquire); p; p = p->next) {
+            cost.calls += p->variable_calls[slot].load(std::memory_order_relaxed);
+            cost.cycles += p->variable_cycles[slot].load(std::memory_order_relaxed);
+        }
+        if (!cost.calls) continue;
+        costs.push_back(cost);
+        total_cycles += cost.cycles;
+    }
+    std::sort(costs.begin(), costs.end(), [](const variable_cost &a, const variable_cost &b) {
+        return a.cycles > b.cycles;
+    });
+
+    std::unordered_map<unsigned, std::string> names = load_variable_names(config.variable_names);
+    path = config.path + ".profile_variables.csv";
+    out = fopen(path.c_str(), "w");
+    if (!out) return;
+    fprintf(out, "variable_id,name,calls,cycles,mean_cycles,share\n");
+    for (const variable_cost &c: costs) {
+        auto it = names.find(c.varid);
+        fprintf(out, "%u,\"%s\",%llu,%llu,%.1f,%.4f\n", c.varid, it == names.end() ? "" : it->second.c_str(),
+                static_cast<unsigned long long>(c.calls), static_cast<unsigned long long>(c.cycles),
+                static_cast<double>(c.cycles) / c.calls, static_cast<double>(c.cycles) / total_cycles);
+    }
+    fclose(out);
+}
+
+// Appends a histogram as space-separated bucket:count pairs.
+static void print_histogram(FILE *out, const unsigned long long (&histogram)[HISTOGRAM_BUCKETS]) {
+    const char *sep = "";
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        if (!histogram[b]) continue;
+        fprintf(out, "%s%d:%llu", sep, b, histogram[b]);
+        sep = " ";
+    }
+}
+
+// Writes a snapshot of every variable's summary to the trace path. The
+// snapshot replaces the previous one atomically. Returns the number of
+// variables written.
+static size_t write_snapshot(const trace_config &config) {
+    // Copy under the lock so the collector waits for a copy, not for I/O.
+    std::mutex &lock = get_lock();
+    lock_profiled(lock);
+    std::vector<std::pair<unsigned, variable_stats>> snapshot(get_variable_stats().begin(),
+                                                              get_variable_stats().end());
+    lock.unlock();
+
+    std::string tmp_path = config.path + ".tmp";
+    FILE *out = fopen(tmp_path.c_str(), "w");
+    if (!out) {
+        perror("log_usage: cannot write snapshot");
+        return 0;
+    }
+
+    fprintf(out, "variable_id,samples,estimated_stores,nonfinite,mean,variance,min,max,last,histogram");
+    for (int i = 0; i < NUM_MEASUREMENTS; i++)
+        fprintf(out, ",cov_%d,corr_%d", i, i);
+    fprintf(out, "\n");
+
+    for (const auto &pair: snapshot) {
+        const variable_stats &s = pair.second;
+        double variance = s.weight > 0.0 ? s.m2 / s.weight : 0.0;
+        fprintf(out, "%u,%llu,%.17g,%llu,%.17g,%.17g,%.17g,%.17g,%.17g,", pair.first, s.samples, s.weight,
+                s.nonfinite, s.mean, variance, s.min, s.max, s.last);
+        print_histogram(out, s.histogram);
+        for (int i = 0; i < NUM_MEASUREMENTS; i++) {
+            double cov = s.weight > 0.0 ? s.comoment[i] / s.weight : 0.0;
+            double denominator = sqrt(s.m2 * s.measurement_m2[i]);
+            double corr = denominator > 0.0 ? s.comoment[i] / denominator : 0.0;
+            fprintf(out, ",%.17g,%.17g", cov, corr);
+        }
+        fprintf(out, "\n");
+    }
+
+    if (fclose(out) != 0 || rename(tmp_path.c_str(), config.path.c_str()) != 0) {
+        perror("log_usage: cannot write snapshot");
+        return 0;
+    }
+    return snapshot.size();
+}
+
+// A variable whose samples match k times a measurement.
+struct fit_evidence {
+    unsigned varid;
+    int measurement;
+    double scale;               // the best of fit_scales
+    double error;               // sum (x - k y)^2 / sum x^2
+    double slope;               // least-squares k, for comparison
+    unsigned long long samples;
+};
+
+// Writes every variable and measurement whose best scale factor fits
+// within the threshold to <trace path>.evidence.csv, best first, and
+// prints the best few. Call once the collector has stopped.
+static void report_evidence(const trace_config &config) {
+    std::vector<fit_evidence> evidence;
+    std::mutex &lock = get_lock();
+    lock.lock();
+    for (const auto &pair: get_variables_to_fits()) {
+        const measurement_fit &fit = pair.second;
+        if (fit.samples < MIN_FIT_SAMPLES || fit.value_sq <= 0.0) continue;
+        for (int i = 0; i < NUM_MEASUREMENTS; i++) {
+            if (fit.measurement_sq[i] <= 0.0) continue;
+            int best = 0;
+            for (int k = 1; k < NUM_FIT_SCALES; k++) {
+                if (fit_error(fit, i, fit_scales[k]) < fit_error(fit, i, fit_scales[best])) best = k;
+            }
+            double error = fit_error(fit, i, fit_scales[best]) / fit.value_sq;
+            if (error > config.fit_threshold) continue;
+            evidence.push_back({pair.first, i, fit_scales[best], error, fit.cross[i] / fit.measurement_sq[i],
+                                fit.samples});
+        }
+    }
+    lock.unlock();
+
+    std::sort(evidence.begin(), evidence.end(), [](const fit_evidence &a, const fit_evidence &b) {
+        return a.error < b.error;
+    });
+    std::unordered_map<unsigned, std::string> names = load_variable_names(config.variable_names);
+    auto name_of = [&](unsigned varid) {
+        auto it = names.find(varid);
+        return it == names.end() ? std::to_string(varid) : it->second;
+    };
+
+    std::string path = config.path + ".evidence.csv";
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) {
+        perror(("log_usage: cannot write " + path).c_str());
+        return;
+    }
+    fprintf(out, "variable_id,name,measurement,scale,relative_error,slope,samples\n");
+    for (const fit_evidence &e: evidence) {
+        fprintf(out, "%u,\"%s\",%s,%g,%.6g,%.17g,%llu\n", e.varid, name_of(e.varid).c_str(),
+                config.measurement_names[e.measurement].c_str(), e.scale, e.error, e.slope, e.samples);
+    }
+    fclose(out);
+
+    std::cerr << "log_usage: " << evidence.size() << " variables match a measurement; see " << path << std::endl;
+    for (size_t n = 0; n < std::min<size_t>(evidence.size(), MAX_EVIDENCE_LINES); n++) {
+        const fit_evidence &e = evidence[n];
+        std::cerr << "log_usage: variable " << name_of(e.varid) << " = " << e.scale << " * "
+                  << config.measurement_names[e.measurement] << " (relative error " << e.error << ", "
+                  << e.samples << " samples)" << std::endl;
+    }
+}
+
+// Stops the collector, drains what it left behind, and writes and closes
+// the trace. Safe to call more than once and from any thread.
+static void shutdown_trace() {
+    static std::atomic<bool> shut_down{false};
+    if (shut_down.exchange(true)) return;
+
+    // Other threads report their runs when they exit; this one may not.
+    // Threads still running keep their buffers: flushing them from here
+    // would race with their owners' stores into the same rings.
+    if (current_ring) {
+        flush_buffer(_instrument_tls);
+        flush_runs(current_ring);
+    }
+
+    std::mutex &lock = get_lock();
+    lock.lock();
+    stopping.store(true, std::memory_order_release);
+    get_writer_wakeup().notify_all();
+    lock.unlock();
+
+    if (writer_thread && writer_thread->get_id() != std::this_thread::get_id())
+        writer_thread->join();
+}
+
+// Records a termination signal; the writer flushes and then re-raises it.
+static void signal_handler(int sig) {
+    pending_signal = sig;
+}
+
+// Installs signal_handler for termination signals the program has not
+// claimed. Signals with their own handlers usually exit normally, which
+// runs the atexit flush.
+static void install_signal_handlers() {
+    for (int sig: {SIGINT, SIGTERM, SIGHUP, SIGQUIT}) {
+        struct sigaction current;
+        if (sigaction(sig, nullptr, &current) != 0 || current.sa_handler != SIG_DFL)
+            continue;
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = signal_handler;
+        sigemptyset(&action.sa_mask);
+        sigaction(sig, &action, nullptr);
+    }
+}
+
+// Returns the committed offset of each claimed region of the ring file.
+// Call with get_lock() held, so that the offsets match what has been
+// drained into the pending readings.
+static std::vector<uint64_t> committed_offsets() {
+    std::vector<uint64_t> offsets;
+    if (!persist_file) return offsets;
+    uint32_t used = std::min(persist_file->regions_used.load(std::memory_order_relaxed), persist_file->num_regions);
+    for (uint32_t i = 0; i < used; i++)
+        offsets.push_back(trace_persist_region_at(persist_file, i)->committed.load(std::memory_order_relaxed));
+    return offsets;
+}
+
+// Records that the readings before the offsets are in the trace, so that
+// recovery skips them.
+static void mark_flushed(const std::vector<uint64_t> &offsets) {
+    for (uint32_t i = 0; i < offsets.size(); i++)
+        trace_persist_region_at(persist_file, i)->flushed.store(offsets[i], std::memory_order_release);
+}
+
+static void print_log() {
+    using namespace std;
+
+    const trace_config &config = get_config();
+    unique_ptr<trace_sink> sink;
+    if (!config.stats) {
+        sink = open_sink(config);
+        if (!sink)
+            cerr << "log_usage: cannot open " << config.path << ": " << strerror(errno) << endl;
+        else
+            write_header(*sink, config);
+    }
+
+    variable_records retired;
+    unordered_map<unsigned, variable_footprint> footprints;
+    mutex &lock = get_lock();
+    bool last = false;
+    auto next_enable_poll = chrono::steady_clock::now();
+
+    while (!last) {
+        // Sleep until the next flush, waking early to stop. Signals are
+        // polled for, since a handler cannot notify a condition variable.
+        unique_lock<mutex> guard(lock);
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(config.flush_period_s);
+        while (!stopping.load(memory_order_acquire) && !pending_signal && chrono::steady_clock::now() < deadline) {
+            get_writer_wakeup().wait_for(guard, chrono::milliseconds(DRAIN_PERIOD_MS));
+            if (chrono::steady_clock::now() >= next_enable_poll) {
+                guard.unlock();
+                poll_enable_file(config);
+                next_enable_poll = chrono::steady_clock::now() + chrono::milliseconds(ENABLE_POLL_MS);
+                guard.lock();
+            }
+        }
+        last = stopping.load(memory_order_acquire) || pending_signal;
+        guard.unlock();
+
+        if (last) {
+            // The poller and the collector have to be gone before we
+            // drain their rings.
+            stopping.store(true, memory_order_release);
+            get_poll_lock().lock();
+            thread *poller = get_poll_registry().poller;
+            get_poll_lock().unlock();
+            if (poller) poller->join();
+            collector_thread->join();
+            drain_rings();
+            if (config.fit) report_evidence(config);
+        }
+
+        unsigned long long start = monotonic_ns();
+        unsigned long long stall_before = log_usage_stall_ns();
+
+        if (config.stats) {
+            size_t count = write_snapshot(config);
+            if (config.profile) {
+                get_thread_profile().flush_ns.record(monotonic_ns() - start);
+                report_profile(config);
+                cerr << "log_usage: wrote a snapshot of " << count << " variables in "
+                     << (monotonic_ns() - start) / 1000000 << " ms; writers stalled "
+                     << log_usage_stall_ns() - stall_before << " ns meanwhile, "
+                     << log_usage_dropped() << " readings dropped so far" << endl;
+            }
+            continue;
+        }
+
+        // Retire the pending readings. The collector starts a fresh epoch,
+        // and nothing below can hold it up.
+        lock_profiled(guard);
+        retired.swap(get_pending_readings());
+        vector<uint64_t> committed = committed_offsets();
+        guard.unlock();
+
+        size_t count = 0;
+        if (sink) {
+            count = config.binary ? write_binary(*sink, retired, config.compress) : write_csv(*sink, retired);
+            mark_flushed(committed);
+        }
+        report_footprint(config, retired, footprints);
+
+        lock_profiled(guard);
+        for (auto &pair: retired)
+            get_chunk_pool().release(pair.second);
+        size_t arena_bytes = get_chunk_pool().footprint();
+        guard.unlock();
+        retired.clear();
+        if (config.profile) {
+            get_thread_profile().flush_ns.record(monotonic_ns() - start);
+            report_profile(config);
+            cerr << "log_usage: appended " << count << " readings in "
+                 << (monotonic_ns() - start) / 1000000 << " ms (arena " << arena_bytes / 1024
+                 << " KiB); writers stalled "
+                 << log_usage_stall_ns() - stall_before << " ns meanwhile, "
+                 << log_usage_dropped() << " readings dropped so far" << endl;
+        }
+    }
+
+    if (sink) sink->finish();
+
+    if (int sig = pending_signal) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+
+// Starts the collector and writer threads and arranges the final flush.
+static bool start_trace() {
+    // Construct everything the exit-time flush uses before registering it.
+    get_config();
+    get_lock();
+    get_writer_wakeup();
+    get_pending_readings();
+    get_variable_stats();
+    get_chunk_pool();
+    get_variables_to_updates();
+    get_variables_to_fits();
+    get_poll_lock();
+    get_poll_registry();
+    ensure_runtime();
+    open_shm_stream(get_config());
+
+    collector_thread = new std::thread(collect_readings);
+    writer_thread = new std::thread(print_log);
+    install_signal_handlers();
+    atexit(shutdown_trace);
+    return true;
 }
 
-std::thread th(print_log);
+static bool trace_started = start_trace();
@@ -0,0 +1,203 @@
+/**
+ * Measures the cost of log_usage() on the instrumented threads, or of the
+ * inline fast path in instrumentation.cpp with "inline", from 1 thread up
+ * to the given number (doubling), and prints ns/call, throughput and the
+ * latency of single calls for each thread count.
+ *
+ * Stores pick variables from a Zipf distribution, so a few variables take
+ * most stores, as in the flight stacks SA4U instruments. One call in
+ * LATENCY_STRIDE is timed on its own for the latency percentiles, less the
+ * cost of reading the timer.
+ *
+ * g++ -O2 -std=gnu++17 log_usage_bench.cpp log_usage.cpp -o log_usage_bench -pthread
+ * SA4U_TRACE_PATH=/tmp/bench.csv ./log_usage_bench [max threads] [calls per thread] [inline]
+ *
+ * See bench_demos.sh for the slowdown of whole instrumented programs.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "instrumentation.cpp"
+
+#define INTEGRAL_TYPE 0
+#define FLOATING_TYPE 1
+
+extern "C" unsigned long long log_usage_dropped();
+extern "C" unsigned long long log_usage_clock();
+
+// Number of distinct variables the benchmark stores to.
+#define NUM_VARIABLES 4096
+// Exponent of the Zipf distribution variables are picked from.
+#define ZIPF_EXPONENT 1.0
+// Variable IDs each thread draws up front and cycles through.
+#define VARID_SEQUENCE (1 << 16)
+// One call in this many is timed on its own.
+#define LATENCY_STRIDE 64
+
+using bench_clock = std::chrono::steady_clock;
+
+// Returns VARID_SEQUENCE variable IDs drawn from the Zipf distribution, so
+// drawing them costs nothing while the benchmark runs.
+static std::vector<unsigned> zipf_varids(unsigned seed) {
+    std::vector<double> cdf(NUM_VARIABLES);
+    double total = 0.0;
+    for (unsigned rank = 0; rank < NUM_VARIABLES; rank++) {
+        total += 1.0 / pow(rank + 1, ZIPF_EXPONENT);
+        cdf[rank] = total;
+    }
+
+    // IDs are random 32-bit numbers other than 0 and 0xffffffff, as the
+    // rewriter's hashes of variable names are.
+    std::vector<unsigned> ids(NUM_VARIABLES);
+    std::mt19937 scatter(12345);
+    for (unsigned &id: ids)
+        id = scatter() % 0xfffffffeu + 1;
+
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<double> uniform(0.0, total);
+    std::vector<unsigned> varids(VARID_SEQUENCE);
+    for (unsigned &varid: varids) {
+        size_t rank = std::lower_bound(cdf.begin(), cdf.end(), uniform(generator)) - cdf.begin();
+        varid = ids[std::min<size_t>(rank, NUM_VARIABLES - 1)];
+    }
+    return varids;
+}
+
+struct bench_values {
+    double d = 0.0;
+    int i = 0;
+};
+
+static inline void store(bench_values &s, unsigned varid) {
+    if (varid & 1) {
+        s.d += 0.5;
+        log_usage(FLOATING_TYPE, varid, &s.d, sizeof(s.d));
+    } else {
+        s.i++;
+        log_usage(INTEGRAL_TYPE, varid, &s.i, sizeof(s.i));
+    }
+}
+
+// The same stores, through the rewriter's macro.
+static inline void inline_store(bench_values &s, unsigned varid) {
+    if (varid & 1)
+        (void) _instrument_noclash(FLOATING_TYPE, varid, (s.d = s.d + 0.5), 0);
+    else
+        (void) _instrument_noclash(INTEGRAL_TYPE, varid, (s.i = s.i + 1), 1);
+}
+
+// Makes calls stores, timing one in LATENCY_STRIDE into latencies.
+template <void (*Store)(bench_values&, unsigned)>
+static void store_loop(unsigned long calls, const std::vector<unsigned> &varids, std::vector<double> &latencies,
+                       const std::atomic<bool> &go) {
+    bench_values s;
+    latencies.reserve(calls / LATENCY_STRIDE + 1);
+    while (!go.load(std::memory_order_acquire))
+        std::this_thread::yield();
+    for (unsigned long n = 0; n < calls; n++) {
+        unsigned varid = varids[n & (VARID_SEQUENCE - 1)];
+        if (n % LATENCY_STRIDE) {
+            Store(s, varid);
+            continue;
+        }
+        auto start = bench_clock::now();
+        Store(s, varid);
+        auto end = bench_clock::now();
+        latencies.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+    }
+}
+
+// Returns the median cost of reading the timer twice, in ns.
+static double timer_cost_ns() {
+    std::vector<double> costs(100000);
+    for (double &cost: costs) {
+        auto start = bench_clock::now();
+        auto end = bench_clock::now();
+        cost = std::chrono::duration<double, std::nano>(end - start).count();
+    }
+    std::nth_element(costs.begin(), costs.begin() + costs.size() / 2, costs.end());
+    return costs[costs.size() / 2];
+}
+
+// Returns the average cost of the timestamp log_usage takes, in ns.
+static double clock_cost_ns(unsigned long calls) {
+    unsigned long long sink = 0;
+    auto start = bench_clock::now();
+    for (unsigned long n = 0; n < calls; n++)
+        sink += log_usage_clock();
+    auto end = bench_clock::now();
+    volatile unsigned long long keep = sink;
+    (void) keep;
+    return std::chrono::duration<double, std::nano>(end - start).count() / calls;
+}
+
+// Returns the q-th quantile of sorted latencies, less the timer's cost.
+static double quantile(const std::vector<double> &sorted, double q, double timer_ns) {
+    if (sorted.empty()) return 0.0;
+    double ns = sorted[std::min<size_t>(sorted.size() * q, sorted.size() - 1)] - timer_ns;
+    return std::max(ns, 0.0);
+}
+
+int main(int argc, char **argv) {
+    unsigned max_threads = argc > 1 ? atoi(argv[1]) : 1;
+    unsigned long calls = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000000;
+    bool inline_path = argc > 3 && strcmp(argv[3], "inline") == 0;
+    if (max_threads == 0 || calls == 0) {
+        fprintf(stderr, "usage: %s [max threads] [calls per thread] [inline]\n", argv[0]);
+        return 1;
+    }
+
+    double timer_ns = timer_cost_ns();
+    printf("path: %s, %u variables (Zipf, s = %.1f), timer %.1f ns, clock %.1f ns\n",
+           inline_path ? "inline" : "log_usage", NUM_VARIABLES, ZIPF_EXPONENT, timer_ns, clock_cost_ns(1000000));
+    printf("%7s %12s %9s %12s %8s %8s %8s %8s %10s\n", "threads", "calls", "ns/call", "Mcalls/s", "p50", "p99",
+           "p99.9", "max", "dropped");
+
+    std::vector<unsigned> thread_counts;
+    for (unsigned t = 1; t < max_threads; t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(max_threads);
+
+    for (unsigned num_threads: thread_counts) {
+        std::vector<std::vector<unsigned>> varids;
+        for (unsigned t = 0; t < num_threads; t++)
+            varids.push_back(zipf_varids(t + 1));
+        std::vector<std::vector<double>> latencies(num_threads);
+        std::atomic<bool> go(false);
+        unsigned long long dropped = log_usage_dropped();
+
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < num_threads; t++) {
+            threads.emplace_back(inline_path ? store_loop<inline_store> : store_loop<store>, calls,
+                                 std::cref(varids[t]), std::ref(latencies[t]), std::cref(go));
+        }
+        auto start = bench_clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto &th: threads)
+            th.join();
+        auto end = bench_clock::now();
+
+        std::vector<double> all;
+        for (const auto &l: latencies)
+            all.insert(all.end(), l.begin(), l.end());
+        std::sort(all.begin(), all.end());
+
+        // Timed calls also pay for the timer, so they count at its cost less.
+        double elapsed_ns = std::chrono::duration<double, std::nano>(end - start).count();
+        double total_calls = static_cast<double>(calls) * num_threads;
+        double call_ns = (elapsed_ns * num_threads - all.size() * timer_ns) / total_calls;
+        printf("%7u %12.0f %9.2f %12.2f %8.1f %8.1f %8.1f %8.1f %10llu\n", num_threads, total_calls, call_ns,
+               total_calls / elapsed_ns * 1e3, quantile(all, 0.5, timer_ns), quantile(all, 0.99, timer_ns),
+               quantile(all, 0.999, timer_ns), all.empty() ? 0.0 : std::max(all.back() - timer_ns, 0.0),
+               log_usage_dropped() - dropped);
+    }
+    return 0;
+}
@@ -0,0 +1,433 @@
+/**
+ * The rewriter as a clang plugin: instruments each translation unit while
+ * the ordinary build compiles it, so instrumentation runs with the build's
+ * own parallelism, parses each unit once, and writes no rewritten file.
+ *
+ * g++ plugin.cpp -o sa4u.so -shared -fPIC -I /usr/lib/llvm-14/include/
+ * -std=c++17
+ *
+ * CXX="clang++-14 -fplugin=sa4u.so -Xclang -plugin-arg-sa4u
+ *   -Xclang instrumentation=path/to/instrumentation.cpp" make -j
+ *
+ * Other arguments, passed the same way: ids=path, the ID database
+ * ($HOME/variable_names.csv by default), and poll, as the rewriter's
+ * --poll. Link the program against log_usage.cpp as usual.
+ *
+ * The plugin includes instrumentation.cpp before the main file, as
+ * -include would, so the main file's lines, and the compile's diagnostics,
+ * are as written. Its consumer sees each top-level declaration before code
+ * generation does, and wraps the stores the rewriter would instrument in
+ * calls to the preamble's _instrument_stored functions, or in polling mode
+ * stores through _instrument_polled, giving each store site a static that
+ * remembers the object it last registered. Unlike the rewriter, it instruments
+ * template instantiations rather than templates, and leaves constexpr
+ * functions alone, since code generation may evaluate them. At the end of
+ * the unit it describes the variables in the sa4u_variables section with
+ * assembler directives, and adds them to the ID database, which is locked
+ * meanwhile, so that parallel compiles notice IDs that collide.
+ */
+#include "clang/Frontend/FrontendPluginRegistry.h"
+#include "clang/Sema/Lookup.h"
+#include "clang/Sema/Sema.h"
+#include "llvm/Support/FileSystem.h"
+
+#define SA4U_REWRITER_PLUGIN
+#include "test.cpp"
+
+// For the layout of the variables' descriptors.
+#include "instrumentation.cpp"
+
+// The ID database.
+static std::string ids_path;
+
+// The instrumentation preamble, made absolute.
+static std::string instrumentation_path;
+
+// Gives varnames their IDs, adding those the ID database lacks. The
+// database stays locked throughout, so that compiles running in parallel
+// see each other's variables and notice IDs that collide. Returns false
+// on a collision or error.
+static bool assign_variable_ids(const std::string &path,
+                                const std::vector<std::string> &varnames) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  FILE *file = fd < 0 ? nullptr : fdopen(fd, "r+");
+  if (!file) {
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  flock(fd, LOCK_EX);
+
+  varname_to_id.clear();
+  id_to_varname.clear();
+  bool ok = read_variable_ids(file, varname_to_id, path);
+  for (const auto &it : varname_to_id) id_to_varname[it.second] = it.first;
+  std::map<std::string, unsigned> known = varname_to_id;
+  bool collided = false;
+  for (const std::string &varname : varnames) {
+    unsigned id;
+    if (!get_variable_id(varname, id)) collided = true;
+  }
+
+  if (!collided && varname_to_id != known) {
+    rewind(file);
+    if (ftruncate(fd, 0) != 0) ok = false;
+    fprintf(file, "name,id\n");
+    for (const auto &it : varname_to_id)
+      fprintf(file, "%s,%u\n", it.first.c_str(), it.second);
+  }
+  if (fclose(file) != 0) ok = false;
+  return ok && !collided;
+}
+
+// Returns assembler directives that append a variable's descriptor, laid
+// out as _instrument_describe lays it out, to the sa4u_variables section.
+static std::string describe_variable(const VariableDescriptor &var,
+                                     const std::string &filename) {
+  std::string text = var.name + '\0' + filename + '\0';
+  text.resize((text.size() + 7) & ~size_t(7), '\0');
+  std::string bytes;
+  for (unsigned char c : text)
+    bytes += (bytes.empty() ? "" : ",") + std::to_string(c);
+  return "\t.pushsection sa4u_variables,\"a\"\n"
+         "\t.balign 8\n"
+         "\t.4byte " + std::to_string(_INSTRUMENT_VARIABLE_MAGIC) + "," +
+         std::to_string(sizeof(_instrument_variable) + text.size()) + "," +
+         std::to_string(var.id) + "," + std::to_string(var.line) + "\n" +
+         "\t.2byte " + std::to_string(var.size) + "," +
+         std::to_string(var.name.size() + 1) + "\n" +
+         "\t.byte " + std::to_string(var.type_code) + "," +
+         std::to_string(var.is_signed) + "\n" +
+         "\t.2byte 0\n"
+         "\t.byte " + bytes + "\n"
+         "\t.popsection\n";
+}
+
+// Wraps the stores in a unit's declarations in calls to the preamble, in
+// place, and remembers the variables they store to.
+class StoreInstrumenter : public RecursiveASTVisitor<StoreInstrumenter> {
+ public:
+  StoreInstrumenter(CompilerInstance &CI, ASTContext &ctx)
+      : CI(CI), ctx(ctx) {}
+
+  // The stores are replaced as their parents are visited.
+  bool shouldTraversePostOrder() const { return true; }
+
+  // Templates are instrumented as they are instantiated, and constexpr
+  // functions not at all.
+  bool TraverseDecl(Decl *decl) {
+    auto *context = dyn_cast_or_null<DeclContext>(decl);
+    if (context && context->isDependentContext()) return true;
+    auto *function = dyn_cast_or_null<FunctionDecl>(decl);
+    if (function && function->isConstexpr()) return true;
+    return RecursiveASTVisitor<StoreInstrumenter>::TraverseDecl(decl);
+  }
+
+  bool VisitStmt(Stmt *stmt) {
+    for (Stmt *&child : stmt->children())
+      if (Expr *instrumented =
+              instrument(dyn_cast_or_null<BinaryOperator>(child)))
+        child = instrumented;
+    return true;
+  }
+
+  // A reference may be bound to a store directly.
+  bool VisitVarDecl(VarDecl *var) {
+    if (Expr *instrumented =
+            instrument(dyn_cast_or_null<BinaryOperator>(var->getInit())))
+      var->setInit(instrumented);
+    return true;
+  }
+
+  // Instruments a top-level declaration, naming the variables its methods
+  // store to as the rewriter does.
+  void instrument_decl(Decl *decl) {
+    tracker.clear();
+    if (auto *method = dyn_cast<CXXMethodDecl>(decl))
+      tracker.add_to_ctx(method->getParent()->getNameAsString());
+    TraverseDecl(decl);
+  }
+
+  // Names of the variables stored to, first store first.
+  std::vector<std::string> varnames;
+
+  // The variables stored to, by ID.
+  std::map<unsigned, VariableDescriptor> variables;
+
+  // Statics added for polled store sites since the last declaration,
+  // which code generation has yet to see.
+  std::vector<Decl *> sites;
+
+ private:
+  // Returns what op is to be replaced with if the rewriter would
+  // instrument it, or nullptr.
+  Expr *instrument(BinaryOperator *op) {
+    if (!op || op->getOpcode() != BO_Assign) return nullptr;
+    auto *member = dyn_cast<MemberExpr>(op->getLHS());
+    if (!member || member->refersToBitField() ||
+        op->isInstantiationDependent())
+      return nullptr;
+    SourceManager &sm = ctx.getSourceManager();
+    if (!sm.isInMainFile(op->getExprLoc()) ||
+        !location_writable(sm, op->getExprLoc()))
+      return nullptr;
+
+    QualType type = member->getType()->getCanonicalTypeUnqualified();
+    int type_code;
+    if (type->isRealFloatingType())
+      type_code = FLOATING_TYPE;
+    else if (type->isIntegralOrEnumerationType())
+      type_code = INTEGRAL_TYPE;
+    else
+      return nullptr;
+
+    std::string varname = get_member_ref_qualified(tracker, member);
+    unsigned id = hash_variable_name(varname);
+    uint64_t size = ctx.getTypeSizeInChars(type).getQuantity();
+    Expr *instrumented = poll_mode ? instrument_poll(op, type_code, id, size)
+                                   : instrument_store(op, type_code, id, size);
+    if (!instrumented) return nullptr;
+
+    // The file's first store to a variable describes it.
+    if (!variables.count(id)) {
+      varnames.push_back(varname);
+      variables[id] = {id, type_code,
+                       type->isSignedIntegerOrEnumerationType(), size,
+                       sm.getSpellingLineNumber(op->getBeginLoc()), varname};
+    }
+    return instrumented;
+  }
+
+  // Returns op wrapped in a call that logs the store, or nullptr if op's
+  // type has no such call.
+  Expr *instrument_store(BinaryOperator *op, int type_code, unsigned id,
+                         uint64_t size) {
+    SourceLocation loc = op->getExprLoc();
+    if (ctx.getLangOpts().CPlusPlus)
+      return call("_instrument_stored", {int_literal(type_code, loc),
+                                         unsigned_literal(id, loc), op});
+
+    // In C the store is a value, passed through and converted back.
+    QualType type = op->getType();
+    Expr *vartype = int_literal(type_code, loc);
+    Expr *varid = unsigned_literal(id, loc);
+    Expr *value;
+    if (type->isSpecificBuiltinType(BuiltinType::Float))
+      value = call("_instrument_stored_float", {vartype, varid, op});
+    else if (type->isSpecificBuiltinType(BuiltinType::Double))
+      value = call("_instrument_stored_double", {vartype, varid, op});
+    else if (type->isSpecificBuiltinType(BuiltinType::LongDouble))
+      value = call("_instrument_stored_long_double", {vartype, varid, op});
+    else if (type_code == INTEGRAL_TYPE && size <= 8)
+      value = call("_instrument_stored_int",
+                   {vartype, varid, int_literal(size, loc), op});
+    else
+      return nullptr;
+    if (!value) return nullptr;
+    ExprResult result = CI.getSema().BuildCStyleCastExpr(
+        loc, ctx.getTrivialTypeSourceInfo(type, loc), loc, value);
+    return result.isInvalid() ? nullptr : result.get();
+  }
+
+  // Makes op store through the address _instrument_polled returns, which
+  // registers the object with the poller. Returns op, or nullptr.
+  Expr *instrument_poll(BinaryOperator *op, int type_code, unsigned id,
+                        uint64_t size) {
+    Sema &sema = CI.getSema();
+    SourceLocation loc = op->getExprLoc();
+    Expr *lhs = op->getLHS();
+    ExprResult address = sema.CreateBuiltinUnaryOp(loc, UO_AddrOf, lhs);
+    if (address.isInvalid()) return nullptr;
+    Expr *site = add_site(loc);
+    if (!site) return nullptr;
+    Expr *registered =
+        call("_instrument_polled", {int_literal(type_code, loc),
+                                    unsigned_literal(id, loc), address.get(),
+                                    int_literal(size, loc), site});
+    if (!registered) return nullptr;
+    QualType pointer_type = ctx.getPointerType(lhs->getType());
+    ExprResult pointer = sema.BuildCStyleCastExpr(
+        loc, ctx.getTrivialTypeSourceInfo(pointer_type, loc), loc, registered);
+    if (pointer.isInvalid()) return nullptr;
+    ExprResult target = sema.CreateBuiltinUnaryOp(loc, UO_Deref, pointer.get());
+    if (target.isInvalid()) return nullptr;
+    op->setLHS(target.get());
+    return op;
+  }
+
+  // Adds a file-scope static, null at first, for _instrument_polled to
+  // remember a store site's object in, and returns its address, or nullptr.
+  Expr *add_site(SourceLocation loc) {
+    Sema &sema = CI.getSema();
+    QualType type = ctx.getPointerType(ctx.getCVRQualifiedType(
+        ctx.VoidTy, Qualifiers::Const | Qualifiers::Volatile));
+    std::string name = "_instrument_site_" + std::to_string(num_sites++);
+    auto *var = VarDecl::Create(ctx, ctx.getTranslationUnitDecl(), loc, loc,
+                                &ctx.Idents.get(name), type,
+                                ctx.getTrivialTypeSourceInfo(type, loc),
+                                SC_Static);
+    var->setImplicit();
+    ctx.getTranslationUnitDecl()->addDecl(var);
+    // With an initializer it is a definition in C too, not a tentative one.
+    sema.AddInitializerToDecl(var, int_literal(0, loc), false);
+    if (var->isInvalidDecl()) return nullptr;
+    sites.push_back(var);
+    Expr *ref = sema.BuildDeclRefExpr(var, type, VK_LValue, loc);
+    ExprResult address = sema.CreateBuiltinUnaryOp(loc, UO_AddrOf, ref);
+    return address.isInvalid() ? nullptr : address.get();
+  }
+
+  // Returns a call to one of the preamble's functions, or nullptr if it
+  // cannot be made.
+  Expr *call(const char *name, SmallVector<Expr *, 5> args) {
+    Sema &sema = CI.getSema();
+    SourceLocation loc = args.back()->getExprLoc();
+    LookupResult lookup(sema, &ctx.Idents.get(name), loc,
+                        Sema::LookupOrdinaryName);
+    if (!sema.LookupQualifiedName(lookup, ctx.getTranslationUnitDecl())) {
+      if (!missing_preamble) {
+        missing_preamble = true;
+        DiagnosticsEngine &diagnostics = CI.getDiagnostics();
+        diagnostics.Report(loc, diagnostics.getCustomDiagID(
+                                    DiagnosticsEngine::Warning,
+                                    "sa4u: %0 is not declared; is %1 the "
+                                    "instrumentation preamble?"))
+            << name << instrumentation_path;
+      }
+      return nullptr;
+    }
+    ExprResult callee =
+        sema.BuildDeclarationNameExpr(CXXScopeSpec(), lookup, false);
+    if (callee.isInvalid()) return nullptr;
+    ExprResult result =
+        sema.BuildCallExpr(nullptr, callee.get(), loc, args, loc);
+    return result.isInvalid() ? nullptr : result.get();
+  }
+
+  Expr *int_literal(uint64_t value, SourceLocation loc) {
+    return IntegerLiteral::Create(
+        ctx, llvm::APInt(ctx.getIntWidth(ctx.IntTy), value), ctx.IntTy, loc);
+  }
+
+  Expr *unsigned_literal(uint64_t value, SourceLocation loc) {
+    return IntegerLiteral::Create(
+        ctx, llvm::APInt(ctx.getIntWidth(ctx.UnsignedIntTy), value),
+        ctx.UnsignedIntTy, loc);
+  }
+
+  CompilerInstance &CI;
+  ASTContext &ctx;
+  ContextTracker tracker;
+  bool missing_preamble = false;
+  unsigned num_sites = 0;
+};
+
+// Runs in the compile, ahead of code generation.
+class InstrumentConsumer : public ASTConsumer {
+ public:
+  explicit InstrumentConsumer(CompilerInstance &CI) : CI(CI) {}
+
+  void Initialize(ASTContext &ctx) override {
+    instrumenter = std::make_unique<StoreInstrumenter>(CI, ctx);
+  }
+
+  bool HandleTopLevelDecl(DeclGroupRef group) override {
+    for (Decl *decl : group) instrumenter->instrument_decl(decl);
+
+    // Code generation sees the store sites' statics before their uses.
+    std::vector<Decl *> sites;
+    sites.swap(instrumenter->sites);
+    for (Decl *site : sites)
+      CI.getASTConsumer().HandleTopLevelDecl(DeclGroupRef(site));
+    return true;
+  }
+
+  void HandleTranslationUnit(ASTContext &ctx) override {
+    DiagnosticsEngine &diagnostics = CI.getDiagnostics();
+    if (instrumenter->varnames.empty() || diagnostics.hasErrorOccurred())
+      return;
+
+    if (!assign_variable_ids(ids_path, instrumenter->varnames)) {
+      diagnostics.Report(diagnostics.getCustomDiagID(
+          DiagnosticsEngine::Error, "sa4u: cannot assign variable IDs in %0"))
+          << ids_path;
+      return;
+    }
+
+    // Code generation has not finished the unit yet, so it still emits
+    // declarations handed to it now.
+    SourceManager &sm = ctx.getSourceManager();
+    const FileEntry *main_entry = sm.getFileEntryForID(sm.getMainFileID());
+    std::string filename = main_entry ? main_entry->getName().str() : "";
+    std::string descriptors;
+    for (const auto &it : instrumenter->variables)
+      descriptors += describe_variable(it.second, filename);
+    SourceLocation loc = sm.getLocForEndOfFile(sm.getMainFileID());
+    QualType type = ctx.getConstantArrayType(
+        ctx.CharTy, llvm::APInt(32, descriptors.size() + 1), nullptr,
+        ArrayType::Normal, 0);
+    auto *text = StringLiteral::Create(ctx, descriptors, StringLiteral::Ascii,
+                                       false, type, loc);
+    auto *decl = FileScopeAsmDecl::Create(ctx, ctx.getTranslationUnitDecl(),
+                                          text, loc, loc);
+    ctx.getTranslationUnitDecl()->addDecl(decl);
+    CI.getASTConsumer().HandleTopLevelDecl(DeclGroupRef(decl));
+  }
+
+ private:
+  CompilerInstance &CI;
+  std::unique_ptr<StoreInstrumenter> instrumenter;
+};
+
+class InstrumentAction : public PluginASTAction {
+ public:
+  bool ParseArgs(const CompilerInstance &CI,
+                 const std::vector<std::string> &args) override {
+    DiagnosticsEngine &diagnostics = CI.getDiagnostics();
+    if (getenv("HOME")) ids_path = homedir() + "/variable_names.csv";
+    for (const std::string &arg : args) {
+      if (arg == "poll") {
+        poll_mode = true;
+      } else if (arg.rfind("instrumentation=", 0) == 0) {
+        instrumentation_path = arg.substr(strlen("instrumentation="));
+      } else if (arg.rfind("ids=", 0) == 0) {
+        ids_path = arg.substr(strlen("ids="));
+      } else {
+        diagnostics.Report(diagnostics.getCustomDiagID(
+            DiagnosticsEngine::Error, "sa4u: unknown argument '%0'"))
+            << arg;
+        return false;
+      }
+    }
+    if (instrumentation_path.empty() || ids_path.empty()) {
+      diagnostics.Report(diagnostics.getCustomDiagID(
+          DiagnosticsEngine::Error,
+          "sa4u: needs instrumentation=path, and ids=path without $HOME"));
+      return false;
+    }
+
+    SmallString<256> path(instrumentation_path);
+    if (llvm::sys::fs::make_absolute(path) || !llvm::sys::fs::exists(path)) {
+      diagnostics.Report(diagnostics.getCustomDiagID(
+          DiagnosticsEngine::Error, "sa4u: cannot open %0"))
+          << instrumentation_path;
+      return false;
+    }
+    instrumentation_path = path.str().str();
+    return true;
+  }
+
+  ActionType getActionType() override { return AddBeforeMainAction; }
+
+  // The preprocessor reads the predefines when it enters the main file,
+  // after the consumers are made.
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                                 StringRef file) override {
+    Preprocessor &pp = CI.getPreprocessor();
+    pp.setPredefines(pp.getPredefines() + "#include \"" +
+                     instrumentation_path + "\"\n");
+    return std::make_unique<InstrumentConsumer>(CI);
+  }
+};
+
+static FrontendPluginRegistry::Add<InstrumentAction> instrument_action(
+    "sa4u", "instrument stores to member variables for SA4U");
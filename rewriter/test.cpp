@@ -7,12 +7,18 @@
  * -lclangStaticAnalyzerCheckers -lclangStaticAnalyzerCore -lclangCrossTU
  * -lclangIndex -lclangSerialization -lclangToolingCore -lclangTooling
  * -lclangFormat -Wl,--end-group
+ *
+ * See plugin.cpp to instrument units as the build compiles them instead.
  */
+#include <atomic>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <mutex>
 #include <optional>
 #include <set>
 #include <sstream>
@@ -28,11 +34,15 @@
 #include "clang/Rewrite/Core/Rewriter.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/VirtualFileSystem.h"
 #include "llvm/Support/raw_ostream.h"
 
 extern "C" {
 #include <fcntl.h>
+#include <sys/file.h>
 #include <unistd.h>
 }
 
@@ -44,22 +54,109 @@ using namespace llvm;
 #define INTEGRAL_TYPE 0
 #define FLOATING_TYPE 1
 
+// Bump when a change to the rewriter changes its output, so that results
+// cached by older versions are not reused.
+#define REWRITER_VERSION "3"
+#define CACHE_MAGIC "SA4URWC1"
+
 static cl::OptionCategory tool_category("rewriter");
 
 static std::string instrumentation_function;
 
+// If set, stores register the object they store to for the runtime to poll,
+// rather than being logged.
+static bool poll_mode;
+
 // Files that we've already rewritten.
 static std::set<std::string> rewritten_files;
 
-// Files that we've already inserted our instrumentation preamble into.
-static std::set<std::string> files_with_preamble;
+// Directory results are cached in, or empty to cache nothing. A unit's
+// result is reused, without parsing it, as long as its compile command and
+// the contents of every file it read are unchanged.
+static std::string cache_dir;
+
+// Directory rewritten files are written under, at their absolute paths, or
+// empty to rewrite them in place. The sources are then left as they were,
+// so a baseline build can share them, and output_dir/overlay.yaml maps each
+// rewritten file to its copy for clang's -ivfsoverlay. For compilers
+// without it, build the copies with -iquote naming the original's
+// directory, so quoted includes still find the headers beside it.
+static std::string output_dir;
 
-// Stores the number of bytes we've already inserted into the file.
-static std::map<FileID, size_t> files_to_bytes_inserted;
+// Rewritten files written under output_dir, by their original paths.
+static std::map<std::string, std::string> overlay_files;
 
-// Relates variable names to their integer IDs.
+// Variable IDs are a hash of the variable's qualified name, so a variable
+// has the same ID in every run and every shard of a build. The runtime
+// finds a variable's settings through a hash table (see
+// _instrument_slot_ids), so IDs can use all 32 bits. Two names with the
+// same ID are an error: the rewriter reports both, and one must be renamed.
+// The ID database, variable_names.csv by default, keeps every ID handed
+// out, so that traces from any run can be joined with it and so that
+// shards notice IDs that collide across them.
+#define VARIABLE_ID_BITS 32
+
+// Relates variable names to their integer IDs: those in the ID database,
+// and those this run handed out.
 static std::map<std::string, unsigned> varname_to_id;
 
+// The reverse of varname_to_id.
+static std::map<unsigned, std::string> id_to_varname;
+
+// What we know statically about a variable a file stores to. Emitted into
+// the file with _instrument_describe.
+struct VariableDescriptor {
+  unsigned id;
+  int type_code;
+  bool is_signed;
+  uint64_t size;
+  unsigned line;
+  std::string name;
+};
+
+// Translation units are instrumented independently, possibly in parallel,
+// so variable IDs and instance numbers, which depend on the units before,
+// are left in the rewritten text as placeholders:
+// PLACEHOLDER_MARK, VARIABLE_PLACEHOLDER or INSTANCE_PLACEHOLDER, the
+// unit's own number for it, and PLACEHOLDER_MARK.
+#define PLACEHOLDER_MARK '\x1d'
+#define VARIABLE_PLACEHOLDER 'v'
+#define INSTANCE_PLACEHOLDER 'i'
+
+// What instrumenting one translation unit produced. commit_translation_unit
+// numbers it and writes it out.
+struct TranslationUnitResult {
+  // The main file, as the compile command names it and as the source
+  // manager does, and its absolute path.
+  std::string file;
+  std::string main_file;
+  std::string main_path;
+
+  // Set once the action has finished with the file.
+  bool finished = false;
+
+  // Names of the variables stored to, by the unit's own IDs: in order of
+  // the first store to each.
+  std::vector<std::string> varnames;
+  std::map<std::string, unsigned> varname_to_local_id;
+
+  // Instrumentation calls inserted.
+  unsigned instances = 0;
+
+  // Set once the preamble is inserted into the main file.
+  bool has_preamble = false;
+
+  // The variables the main file stores to, by the unit's own IDs, first
+  // store first.
+  std::vector<VariableDescriptor> variables;
+
+  // Relates the absolute paths of the files rewritten to their text.
+  std::map<std::string, std::string> rewritten;
+
+  // Absolute paths of every file the unit read.
+  std::vector<std::string> inputs;
+};
+
 // Returns if we own a path + can write.
 static bool path_writable(const std::string &path) {
   return access(path.c_str(), W_OK) != -1;
@@ -115,22 +212,211 @@ static std::string get_member_ref_qualified(ContextTracker &tracker,
   return result;
 }
 
-static std::string get_instrumentation_call(int type_code,
-                                            const std::string &varname,
-                                            const std::string &expr) {
-  static int instance_no;
-  static unsigned next_varname_id;
-  if (varname_to_id.find(varname) == varname_to_id.end()) {
-    varname_to_id[varname] = next_varname_id++;
+// Returns the 64-bit FNV-1a hash of bytes.
+static uint64_t hash_bytes(const std::string &bytes) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (unsigned char c : bytes) {
+    hash ^= c;
+    hash *= 0x100000001b3ull;
   }
+  return hash;
+}
 
-  return "_instrument_noclash(" + std::to_string(type_code) + "," +
-         std::to_string(varname_to_id[varname]) + ",(" + expr + ")," +
-         std::to_string(instance_no++) + ")";
+// Returns a variable's ID: its name's 64-bit FNV-1a hash, folded to
+// VARIABLE_ID_BITS. 0, which marks a free slot in the runtime, and
+// 0xffffffff, which marks an empty entry in its caches, are never IDs.
+static unsigned hash_variable_name(const std::string &varname) {
+  const uint64_t mask = (uint64_t(1) << VARIABLE_ID_BITS) - 1;
+  uint64_t hash = hash_bytes(varname);
+  uint64_t folded = 0;
+  for (; hash; hash >>= VARIABLE_ID_BITS) folded ^= hash & mask;
+  return folded % (mask - 1) + 1;
+}
+
+// Sets id to a variable's ID. Returns false, naming both variables, if
+// another variable already has it.
+static bool get_variable_id(const std::string &varname, unsigned &id) {
+  id = hash_variable_name(varname);
+  auto it = id_to_varname.find(id);
+  if (it != id_to_varname.end() && it->second != varname) {
+    std::cerr << "collision: " << varname << " and " << it->second
+              << " both have ID " << id << "; rename one of them"
+              << std::endl;
+    return false;
+  }
+  // A database written by an older rewriter may give the name another ID.
+  auto old = varname_to_id.find(varname);
+  if (old != varname_to_id.end() && old->second != id)
+    id_to_varname.erase(old->second);
+  varname_to_id[varname] = id;
+  id_to_varname[id] = varname;
+  return true;
+}
+
+// Reads name,id lines from an ID database into ids. Returns false if a
+// name or an ID appears twice.
+static bool read_variable_ids(FILE *in, std::map<std::string, unsigned> &ids,
+                              const std::string &path) {
+  std::set<unsigned> seen;
+  char line[4096];
+  bool ok = true;
+  while (fgets(line, sizeof(line), in)) {
+    char *comma = strrchr(line, ',');
+    if (!comma) continue;
+    char *end;
+    unsigned long id = strtoul(comma + 1, &end, 10);
+    if (end == comma + 1) continue;  // the header
+    std::string varname(line, comma);
+    if (!ids.insert({varname, id}).second || !seen.insert(id).second) {
+      std::cerr << path << ": " << varname << " or ID " << id
+                << " appears twice" << std::endl;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// Loads the ID database, if there is one.
+static bool load_variable_ids(const std::string &path) {
+  FILE *in = fopen(path.c_str(), "r");
+  if (!in) return true;
+  flock(fileno(in), LOCK_SH);
+  bool ok = read_variable_ids(in, varname_to_id, path);
+  fclose(in);
+  for (const auto &it : varname_to_id) id_to_varname[it.second] = it.first;
+  return ok;
+}
+
+// Adds the IDs this run handed out to the ID database. Other runs, such as
+// shards of the same build, may have added IDs since it was loaded; an ID
+// they gave a different variable is a collision, and one of the two must
+// be renamed. Returns false on a collision or error.
+static bool save_variable_ids(const std::string &path) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  FILE *file = fd < 0 ? nullptr : fdopen(fd, "r+");
+  if (!file) {
+    std::cerr << "cannot open: " << path << std::endl;
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  flock(fd, LOCK_EX);
+
+  std::map<std::string, unsigned> saved;
+  bool ok = read_variable_ids(file, saved, path);
+  std::map<unsigned, std::string> saved_ids;
+  for (const auto &it : saved) saved_ids[it.second] = it.first;
+  for (const auto &it : varname_to_id) {
+    auto by_name = saved.find(it.first);
+    auto by_id = saved_ids.find(it.second);
+    if (by_id != saved_ids.end() && by_id->second != it.first) {
+      std::cerr << "collision: " << it.first << " and " << by_id->second
+                << " both have ID " << it.second << "; rename one of them"
+                << std::endl;
+      ok = false;
+    } else {
+      // An ID an older rewriter gave the name is replaced.
+      if (by_name != saved.end()) saved_ids.erase(by_name->second);
+      saved[it.first] = it.second;
+      saved_ids[it.second] = it.first;
+    }
+  }
+
+  rewind(file);
+  if (ftruncate(fd, 0) != 0) ok = false;
+  fprintf(file, "name,id\n");
+  for (const auto &it : saved)
+    fprintf(file, "%s,%u\n", it.first.c_str(), it.second);
+  if (fclose(file) != 0) {
+    std::cerr << "cannot write: " << path << std::endl;
+    ok = false;
+  }
+  return ok;
+}
+
+// Returns the unit's own ID for a variable.
+static unsigned get_local_variable_id(TranslationUnitResult &unit,
+                                      const std::string &varname) {
+  auto it = unit.varname_to_local_id.find(varname);
+  if (it != unit.varname_to_local_id.end()) return it->second;
+  unit.varnames.push_back(varname);
+  return unit.varname_to_local_id[varname] = unit.varnames.size() - 1;
+}
+
+static std::string placeholder(char kind, unsigned local_no) {
+  return PLACEHOLDER_MARK + std::string(1, kind) + std::to_string(local_no) +
+         PLACEHOLDER_MARK;
+}
+
+static std::string get_instrumentation_call(TranslationUnitResult &unit,
+                                            int type_code, unsigned local_id,
+                                            const std::string &lhs,
+                                            const std::string &rhs) {
+  std::string id = placeholder(VARIABLE_PLACEHOLDER, local_id);
+  std::string instance_no =
+      placeholder(INSTANCE_PLACEHOLDER, unit.instances++);
+  if (poll_mode)
+    return "_instrument_register(" + std::to_string(type_code) + "," + id +
+           ",(" + lhs + "),(" + rhs + ")," + instance_no + ")";
+  return "_instrument_noclash(" + std::to_string(type_code) + "," + id +
+         ",(" + lhs + "=" + rhs + ")," + instance_no + ")";
+}
+
+// Returns text with its placeholders replaced by the variables' IDs and by
+// instance numbers counted from first_instance_no.
+static std::string fill_placeholders(const std::string &text,
+                                     const std::vector<unsigned> &ids,
+                                     unsigned first_instance_no) {
+  std::string result;
+  result.reserve(text.size());
+  size_t pos = 0;
+  while (true) {
+    size_t start = text.find(PLACEHOLDER_MARK, pos);
+    if (start == std::string::npos) break;
+    size_t end = text.find(PLACEHOLDER_MARK, start + 1);
+    assert(end != std::string::npos);
+    result.append(text, pos, start - pos);
+    unsigned local_no = std::stoul(text.substr(start + 2, end - start - 2));
+    if (text[start + 1] == VARIABLE_PLACEHOLDER)
+      result += std::to_string(ids[local_no]);
+    else
+      result += std::to_string(first_instance_no + local_no);
+    pos = end + 1;
+  }
+  result.append(text, pos, std::string::npos);
+  return result;
+}
+
+// Returns str as a C string literal.
+static std::string quote(const std::string &str) {
+  std::string result = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') result += '\\';
+    result += c;
+  }
+  return result + "\"";
+}
+
+// Returns the descriptors for the variables a file stores to, to append
+// to it.
+static std::string get_variable_descriptors(
+    const std::string &filename,
+    const std::map<unsigned, VariableDescriptor> &variables) {
+  std::string result = "\n";
+  for (const auto &it : variables) {
+    const VariableDescriptor &var = it.second;
+    result += "_instrument_describe(" + std::to_string(var.id) + "," +
+              std::to_string(var.type_code) + "," +
+              std::to_string(var.is_signed) + "," +
+              std::to_string(var.size) + "," + std::to_string(var.line) +
+              "," + quote(var.name) + "," + quote(filename) + ");\n";
+  }
+  return result;
 }
 
 static void instrument_function(Rewriter &rewriter, ASTContext &ctx,
-                                ContextTracker &tracker, BinaryOperator *op) {
+                                ContextTracker &tracker,
+                                TranslationUnitResult &unit,
+                                BinaryOperator *op) {
   Expr *lhs = op->getLHS();
 
   assert(isa<MemberExpr>(lhs));
@@ -153,13 +439,15 @@ static void instrument_function(Rewriter &rewriter, ASTContext &ctx,
     return;
   }
 
-  std::string filename(sm.getFilename(op->getBeginLoc()));
-  if (files_with_preamble.find(filename) == files_with_preamble.end()) {
-    files_with_preamble.insert(filename);
+  // A #line follows the preamble, so the file's own lines keep their
+  // numbers in diagnostics, __LINE__ and debug info.
+  if (!unit.has_preamble) {
+    unit.has_preamble = true;
     FileID id = sm.getFileID(op->getExprLoc());
     SourceLocation loc = sm.getLocForStartOfFile(id);
-    rewriter.InsertTextBefore(loc, instrumentation_function);
-    files_to_bytes_inserted[id] += instrumentation_function.length();
+    rewriter.InsertTextBefore(
+        loc, instrumentation_function + "#line 1 " +
+                 quote(std::string(sm.getFilename(loc))) + "\n");
   }
 
   // Find the location in the source code of this expression.
@@ -182,12 +470,19 @@ static void instrument_function(Rewriter &rewriter, ASTContext &ctx,
   // Build the instrumentation call.
   MemberExpr *expr = cast<MemberExpr>(lhs);
   std::string lhs_qual = get_member_ref_qualified(tracker, expr);
-  std::string stmt;
-  raw_string_ostream stream(stmt);
+  unsigned id = get_local_variable_id(unit, lhs_qual);
+  std::string lhs_text;
+  raw_string_ostream stream(lhs_text);
   op->getLHS()->printPretty(stream, nullptr, PrintingPolicy(ctx.getLangOpts()));
-  stream << "=" << rhs_text;
+  stream.flush();
   std::string instrumented_assignment =
-      get_instrumentation_call(type_code, lhs_qual, stmt);
+      get_instrumentation_call(unit, type_code, id, lhs_text, rhs_text);
+
+  // Describe the variable; the file's first store to it is the one kept.
+  unit.variables.push_back(
+      {id, type_code, lhs_type->isSignedIntegerOrEnumerationType(),
+       static_cast<uint64_t>(ctx.getTypeSizeInChars(lhs_type).getQuantity()),
+       sm.getSpellingLineNumber(op->getBeginLoc()), lhs_qual});
 
   if (op->getEndLoc().isMacroID())
     rewriter.RemoveText(SourceRange(
@@ -201,21 +496,31 @@ static void instrument_function(Rewriter &rewriter, ASTContext &ctx,
                       instrumented_assignment);
 }
 
+// Returns if we own the file a location is in + can write. Units may run
+// in parallel, each with its own working directory, so the path is made
+// absolute with the unit's file manager rather than the process's.
+static bool location_writable(const SourceManager &sm, SourceLocation loc) {
+  SmallString<256> path(sm.getFilename(loc));
+  if (path.empty()) return false;
+  sm.getFileManager().makeAbsolutePath(path);
+  return path_writable(path.str().str());
+}
+
 class RewritingVisitor : public RecursiveASTVisitor<RewritingVisitor> {
  public:
-  RewritingVisitor(Rewriter &R, ASTContext &c)
-      : TheRewriter(R), ast_context(c), compound_stmt_depth(0) {}
+  RewritingVisitor(Rewriter &R, ASTContext &c, TranslationUnitResult &unit)
+      : TheRewriter(R), ast_context(c), unit(unit), compound_stmt_depth(0) {}
 
   bool shouldTraversePostOrder() const { return true; }
 
   bool VisitBinaryOperator(BinaryOperator *op) {
     if (op && op->getOpcode() == BO_Assign) {
       Expr *lhs = op->getLHS();
-      std::string filename(
-          ast_context.getSourceManager().getFilename(op->getExprLoc()));
       if (lhs && isa<MemberExpr>(lhs) && !op->getLHS()->refersToBitField() &&
-          !op->isInstantiationDependent() && path_writable(filename)) {
-        instrument_function(TheRewriter, ast_context, tracker, op);
+          !op->isInstantiationDependent() &&
+          location_writable(ast_context.getSourceManager(),
+                            op->getExprLoc())) {
+        instrument_function(TheRewriter, ast_context, tracker, unit, op);
       }
     }
     return true;
@@ -231,14 +536,16 @@ class RewritingVisitor : public RecursiveASTVisitor<RewritingVisitor> {
   std::string function_name;
   ContextTracker tracker;
   ASTContext &ast_context;
+  TranslationUnitResult &unit;
 };
 
 // Implementation of the ASTConsumer interface for reading an AST produced
 // by the Clang parser.
 class MyASTConsumer : public ASTConsumer {
  public:
-  MyASTConsumer(Rewriter &R, ASTContext &a, const std::string &file)
-      : Visitor(R, a), file(file) {}
+  MyASTConsumer(Rewriter &R, ASTContext &a, TranslationUnitResult &unit,
+                const std::string &file)
+      : Visitor(R, a, unit), file(file) {}
 
   // Override the method that gets called for each parsed top-level
   // declaration.
@@ -273,16 +580,34 @@ class MyASTConsumer : public ASTConsumer {
 // For each source file provided to the tool, a new FrontendAction is created.
 class MyFrontendAction : public ASTFrontendAction {
  public:
-  MyFrontendAction() {}
+  explicit MyFrontendAction(TranslationUnitResult &unit) : unit(unit) {}
   void EndSourceFileAction() override {
     SourceManager &SM = TheRewriter.getSourceMgr();
 
-    if (rewritten_files.find(the_file) == rewritten_files.end()) {
-      // Now emit the rewritten buffer.
-      // TheRewriter.getEditBuffer(SM.getMainFileID()).write(llvm::outs());
-      TheRewriter.overwriteChangedFiles();
-      rewritten_files.insert(the_file);
+    // Keep the rewritten buffers; commit_translation_unit writes them.
+    const FileEntry *main_entry = SM.getFileEntryForID(SM.getMainFileID());
+    unit.main_file = std::string(main_entry->getName());
+    for (auto it = TheRewriter.buffer_begin(); it != TheRewriter.buffer_end();
+         ++it) {
+      const FileEntry *entry = SM.getFileEntryForID(it->first);
+      if (!entry) continue;
+      SmallString<256> path(entry->getName());
+      SM.getFileManager().makeAbsolutePath(path);
+      std::string text;
+      raw_string_ostream stream(text);
+      it->second.write(stream);
+      stream.flush();
+      unit.rewritten[path.str().str()] = text;
+      if (entry == main_entry) unit.main_path = path.str().str();
     }
+
+    // Note what the unit read, for the cache.
+    for (auto it = SM.fileinfo_begin(); it != SM.fileinfo_end(); ++it) {
+      SmallString<256> path(it->first->getName());
+      SM.getFileManager().makeAbsolutePath(path);
+      unit.inputs.push_back(path.str().str());
+    }
+    unit.finished = true;
   }
 
   std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
@@ -291,7 +616,7 @@ class MyFrontendAction : public ASTFrontendAction {
     SourceManager &sm = TheRewriter.getSourceMgr();
 
     the_file = file;
-    std::cout << "In: " << the_file << std::endl;
+    unit.file = the_file;
 
     if (the_file == "./../libraries/AP_Baro/AP_Baro_UAVCAN.cpp") return nullptr;
 
@@ -299,12 +624,43 @@ class MyFrontendAction : public ASTFrontendAction {
     // TheRewriter.InsertText(sm.getLocForStartOfFile(sm.getMainFileID()),
     // instrumentation_function);
     return std::make_unique<MyASTConsumer>(TheRewriter, CI.getASTContext(),
-                                           the_file);
+                                           unit, the_file);
   }
 
  private:
   Rewriter TheRewriter;
   std::string the_file;
+  TranslationUnitResult &unit;
+};
+
+// Creates actions that record what they do in one TranslationUnitResult.
+class MyFrontendActionFactory : public FrontendActionFactory {
+ public:
+  explicit MyFrontendActionFactory(TranslationUnitResult &unit)
+      : unit(unit) {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<MyFrontendAction>(unit);
+  }
+
+ private:
+  TranslationUnitResult &unit;
+};
+
+// Presents one compile command as the only one for its file, so that a
+// file's commands can be run one at a time.
+class SingleCommandDatabase : public CompilationDatabase {
+ public:
+  explicit SingleCommandDatabase(CompileCommand command)
+      : command(std::move(command)) {}
+
+  std::vector<CompileCommand> getCompileCommands(
+      StringRef file) const override {
+    return {command};
+  }
+
+ private:
+  CompileCommand command;
 };
 
 static std::optional<std::string> slurp_file(const std::string &path) {
@@ -336,50 +692,439 @@ static std::string homedir() {
     return getenv("HOME");
 }
 
+// Content hashes of the files units have read, by absolute path. Guarded
+// by file_hashes_lock.
+static std::mutex file_hashes_lock;
+static std::map<std::string, std::optional<uint64_t>> file_hashes;
+
+// Returns the hash of a file's contents, or nothing if it cannot be read.
+static std::optional<uint64_t> hash_file(const std::string &path) {
+  {
+    std::lock_guard<std::mutex> guard(file_hashes_lock);
+    auto it = file_hashes.find(path);
+    if (it != file_hashes.end()) return it->second;
+  }
+  std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+  std::optional<uint64_t> hash;
+  if (in) {
+    std::string contents((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+    if (!in.bad()) hash = hash_bytes(contents);
+  }
+  std::lock_guard<std::mutex> guard(file_hashes_lock);
+  return file_hashes[path] = hash;
+}
+
+// Forgets a file's hash, once the file is rewritten.
+static void forget_file_hash(const std::string &path) {
+  std::lock_guard<std::mutex> guard(file_hashes_lock);
+  file_hashes.erase(path);
+}
+
+// Returns what a unit's cached result depends on besides its inputs.
+static std::string get_cache_key(const CompileCommand &command) {
+  std::string key = REWRITER_VERSION;
+  key += poll_mode ? "\npoll\n" : "\nstore\n";
+  key += std::to_string(hash_bytes(instrumentation_function));
+  key += "\n" + command.Directory + "\n" + command.Filename;
+  for (const std::string &arg : command.CommandLine) key += "\n" + arg;
+  return key;
+}
+
+static std::string get_cache_path(const std::string &key) {
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx",
+           static_cast<unsigned long long>(hash_bytes(key)));
+  return cache_dir + "/" + name;
+}
+
+// A cache entry is CACHE_MAGIC, then the key, the unit's inputs with their
+// hashes, and the unit's result, as numbers and length-prefixed strings.
+class CacheWriter {
+ public:
+  explicit CacheWriter(std::ostream &out) : out(out) {}
+
+  void number(uint64_t n) { out.write(reinterpret_cast<char *>(&n), 8); }
+
+  void string(const std::string &str) {
+    number(str.size());
+    out.write(str.data(), str.size());
+  }
+
+ private:
+  std::ostream &out;
+};
+
+class CacheReader {
+ public:
+  explicit CacheReader(std::istream &in) : in(in) {}
+
+  uint64_t number() {
+    uint64_t n = 0;
+    in.read(reinterpret_cast<char *>(&n), 8);
+    return n;
+  }
+
+  std::string string() {
+    uint64_t size = number();
+    if (!in) return "";
+    std::string str(size, '\0');
+    in.read(&str[0], size);
+    return str;
+  }
+
+  bool ok() const { return bool(in); }
+
+ private:
+  std::istream &in;
+};
+
+// Fills unit with the result cached for key, if its inputs are unchanged.
+// Returns false if there is none.
+static bool load_cached_unit(const std::string &key,
+                             TranslationUnitResult &unit) {
+  std::ifstream in(get_cache_path(key), std::ios_base::binary);
+  char magic[sizeof(CACHE_MAGIC)] = {};
+  in.read(magic, sizeof(magic) - 1);
+  if (!in || std::string(magic) != CACHE_MAGIC) return false;
+  CacheReader reader(in);
+  if (reader.string() != key) return false;
+
+  TranslationUnitResult cached;
+  for (uint64_t i = 0, n = reader.number(); i < n && reader.ok(); i++) {
+    std::string path = reader.string();
+    uint64_t hash = reader.number();
+    if (!reader.ok() || hash_file(path) != hash) return false;
+    cached.inputs.push_back(path);
+  }
+  cached.file = reader.string();
+  cached.main_file = reader.string();
+  cached.main_path = reader.string();
+  cached.finished = true;
+  for (uint64_t i = 0, n = reader.number(); i < n && reader.ok(); i++)
+    cached.varnames.push_back(reader.string());
+  cached.instances = reader.number();
+  for (uint64_t i = 0, n = reader.number(); i < n && reader.ok(); i++) {
+    VariableDescriptor var;
+    var.id = reader.number();
+    var.type_code = reader.number();
+    var.is_signed = reader.number();
+    var.size = reader.number();
+    var.line = reader.number();
+    var.name = reader.string();
+    cached.variables.push_back(var);
+  }
+  for (uint64_t i = 0, n = reader.number(); i < n && reader.ok(); i++) {
+    std::string path = reader.string();
+    cached.rewritten[path] = reader.string();
+  }
+  if (!reader.ok()) return false;
+  unit = std::move(cached);
+  return true;
+}
+
+// Caches a unit's result under key. The entry is renamed into place, so
+// concurrent runs sharing the cache never see part of one.
+static void store_cached_unit(const std::string &key,
+                              const TranslationUnitResult &unit) {
+  static std::atomic<unsigned> next_temporary;
+  std::string path = get_cache_path(key);
+  std::string temporary = path + ".tmp." + std::to_string(getpid()) + "." +
+                          std::to_string(next_temporary++);
+  std::ofstream out(temporary, std::ios_base::binary | std::ios_base::trunc);
+  out << CACHE_MAGIC;
+  CacheWriter writer(out);
+  writer.string(key);
+  writer.number(unit.inputs.size());
+  for (const std::string &input : unit.inputs) {
+    std::optional<uint64_t> hash = hash_file(input);
+    if (!hash) {
+      out.close();
+      unlink(temporary.c_str());
+      return;
+    }
+    writer.string(input);
+    writer.number(*hash);
+  }
+  writer.string(unit.file);
+  writer.string(unit.main_file);
+  writer.string(unit.main_path);
+  writer.number(unit.varnames.size());
+  for (const std::string &varname : unit.varnames) writer.string(varname);
+  writer.number(unit.instances);
+  writer.number(unit.variables.size());
+  for (const VariableDescriptor &var : unit.variables) {
+    writer.number(var.id);
+    writer.number(var.type_code);
+    writer.number(var.is_signed);
+    writer.number(var.size);
+    writer.number(var.line);
+    writer.string(var.name);
+  }
+  writer.number(unit.rewritten.size());
+  for (const auto &it : unit.rewritten) {
+    writer.string(it.first);
+    writer.string(it.second);
+  }
+  out.close();
+  if (!out || rename(temporary.c_str(), path.c_str()) != 0)
+    unlink(temporary.c_str());
+}
+
+// Instruments the translation unit of one of a file's compile commands
+// into unit, leaving the files it reads as they are. Returns
+// ClangTool::run's status.
+static int instrument_translation_unit(const std::string &file,
+                                       const CompileCommand &command,
+                                       TranslationUnitResult &unit) {
+  std::string key;
+  if (!cache_dir.empty()) {
+    key = get_cache_key(command);
+    if (load_cached_unit(key, unit)) return 0;
+  }
+
+  SingleCommandDatabase database(command);
+
+  // Each unit gets its own file system, so units running in parallel can
+  // each be in their command's directory.
+  IntrusiveRefCntPtr<llvm::vfs::FileSystem> file_system =
+      llvm::vfs::createPhysicalFileSystem();
+  ClangTool Tool(database, {file}, std::make_shared<PCHContainerOperations>(),
+                 file_system);
+  Tool.setPrintErrorMessage(false);
+
+  NoOpDiagnosticConsumer diagnosis_consumer;
+  Tool.setDiagnosticConsumer(&diagnosis_consumer);
+
+  MyFrontendActionFactory factory(unit);
+  int status = Tool.run(&factory);
+  if (!cache_dir.empty() && status == 0 && unit.finished)
+    store_cached_unit(key, unit);
+  return status;
+}
+
+// Returns the path to write the rewritten file at path to: path itself, or
+// its copy under output_dir, whose directories are created. Returns an
+// empty string if they cannot be.
+static std::string get_output_path(const std::string &path) {
+  if (output_dir.empty()) return path;
+  std::filesystem::path copy = output_dir + path;
+  std::error_code error;
+  if (!std::filesystem::create_directories(copy.parent_path(), error) &&
+      error) {
+    std::cerr << "cannot create " << copy.parent_path().string() << std::endl;
+    return "";
+  }
+  overlay_files[path] = copy.string();
+  return copy.string();
+}
+
+// Returns the text of the files a unit rewrote, by their absolute paths,
+// with its variables' IDs and instance numbers from first_instance_no in
+// place of the placeholders, and the main file's variable descriptors
+// appended to it.
+static std::map<std::string, std::string> number_translation_unit(
+    const TranslationUnitResult &unit, const std::vector<unsigned> &ids,
+    unsigned first_instance_no) {
+  // Describe each variable the main file stores to once.
+  std::map<unsigned, VariableDescriptor> variables;
+  for (VariableDescriptor var : unit.variables) {
+    var.id = ids[var.id];
+    variables.insert({var.id, var});
+  }
+
+  std::map<std::string, std::string> result;
+  for (const auto &it : unit.rewritten) {
+    std::string text = fill_placeholders(it.second, ids, first_instance_no);
+    if (it.first == unit.main_path && !variables.empty())
+      text += get_variable_descriptors(unit.main_file, variables);
+    result[it.first] = text;
+  }
+  return result;
+}
+
+// Numbers a unit's variables and instrumentation calls in the order of the
+// whole run, and writes the files it rewrote, unless an earlier command
+// already rewrote its main file. Returns false if a variable's ID collides
+// or a file cannot be written.
+static bool commit_translation_unit(const TranslationUnitResult &unit) {
+  static unsigned next_instance_no;
+  if (!unit.file.empty()) std::cout << "In: " << unit.file << std::endl;
+
+  bool ok = true;
+  std::vector<unsigned> ids;
+  for (const std::string &varname : unit.varnames) {
+    unsigned id;
+    if (!get_variable_id(varname, id)) ok = false;
+    ids.push_back(id);
+  }
+  unsigned first_instance_no = next_instance_no;
+  next_instance_no += unit.instances;
+  if (!ok) return false;
+  if (!unit.finished || !rewritten_files.insert(unit.file).second)
+    return true;
+
+  for (const auto &it : number_translation_unit(unit, ids, first_instance_no)) {
+    const std::string &text = it.second;
+    std::string path = get_output_path(it.first);
+    if (path.empty()) {
+      ok = false;
+      continue;
+    }
+    if (output_dir.empty()) forget_file_hash(it.first);
+    std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+    out << text;
+    out.close();
+    if (!out) {
+      std::cerr << "cannot write: " << path << std::endl;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// Quotes s for a YAML (and JSON) document.
+static std::string yaml_quote(const std::string &s) {
+  std::string quoted = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+// Writes output_dir/overlay.yaml, which has clang read each file rewritten
+// this run from its copy under output_dir. Returns false on failure.
+static bool write_overlay() {
+  std::string path = output_dir + "/overlay.yaml";
+  std::ofstream out(path, std::ios_base::trunc);
+  out << "{\n  \"version\": 0,\n  \"roots\": [";
+  const char *separator = "\n";
+  for (const auto &it : overlay_files) {
+    out << separator << "    {\"type\": \"file\", \"name\": "
+        << yaml_quote(it.first)
+        << ", \"external-contents\": " << yaml_quote(it.second) << "}";
+    separator = ",\n";
+  }
+  out << "\n  ]\n}\n";
+  out.close();
+  if (!out) {
+    std::cerr << "cannot write: " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Folds a unit's ClangTool::run status into the run's: 1 if any unit
+// failed, else 2 if any file was skipped.
+static void merge_status(int &ret, int status) {
+  if (ret != 1 && status != 0) ret = status;
+}
+
+#ifndef SA4U_REWRITER_PLUGIN
 int main(int argc, const char **argv) {
-  if (argc != 3) {
+  std::vector<std::string> args;
+  unsigned jobs = 1;
+  std::string ids_path = homedir() + "/variable_names.csv";
+  cache_dir = homedir() + "/.cache/sa4u-rewriter";
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--poll")
+      poll_mode = true;
+    else if (arg == "-j" && i + 1 < argc)
+      jobs = std::strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--ids" && i + 1 < argc)
+      ids_path = argv[++i];
+    else if (arg == "--cache" && i + 1 < argc)
+      cache_dir = argv[++i];
+    else if (arg == "--no-cache")
+      cache_dir.clear();
+    else if (arg == "--output" && i + 1 < argc)
+      output_dir = argv[++i];
+    else
+      args.push_back(arg);
+  }
+  if (args.size() != 2 || jobs == 0) {
     std::cerr
         << "usage: " << argv[0]
         << " [compilation database path] [path to instrumentation source code]"
+        << " [--poll] [-j jobs] [--ids ID database]"
+        << " [--cache directory | --no-cache] [--output directory]"
         << std::endl;
     return 1;
   }
+  if (!load_variable_ids(ids_path)) return 1;
+  std::error_code error;
+  if (!cache_dir.empty() &&
+      !std::filesystem::create_directories(cache_dir, error) && error) {
+    std::cerr << "cannot create " << cache_dir << "; not caching" << std::endl;
+    cache_dir.clear();
+  }
+  if (!output_dir.empty()) {
+    output_dir =
+        std::filesystem::absolute(output_dir).lexically_normal().string();
+    if (output_dir.size() > 1 && output_dir.back() == '/')
+      output_dir.pop_back();
+  }
 
-  std::optional<std::string> instrumentation_source = slurp_file(argv[2]);
+  std::optional<std::string> instrumentation_source = slurp_file(args[1]);
   if (!instrumentation_source) {
-    std::cerr << "cannot open: " << argv[2] << std::endl;
+    std::cerr << "cannot open: " << args[1] << std::endl;
     return 1;
   }
   instrumentation_function = instrumentation_source.value() + "\n";
 
   std::string msg = "cannot load compilation database";
   auto compilation_database =
-      CompilationDatabase::loadFromDirectory(argv[1], msg);
+      CompilationDatabase::loadFromDirectory(args[0], msg);
   if (!compilation_database) {
     llvm::errs() << "HERE cannot load compilation database\n";
     return 1;
   }
 
-  ClangTool Tool(*compilation_database,
-                 ArrayRef<std::string>(compilation_database->getAllFiles()));
-  Tool.setPrintErrorMessage(false);
-
-  NoOpDiagnosticConsumer diagnosis_consumer;
-  Tool.setDiagnosticConsumer(&diagnosis_consumer);
+  // Each file's first compile command is instrumented on its own, up to
+  // jobs at a time, from the sources as they were. The results are
+  // numbered and written in the order of the database, so the output is
+  // the same for any number of jobs. A file's other commands run once it
+  // is written, on the rewritten file (or, with --output, the original);
+  // they only use up IDs and instance numbers, since a file is only
+  // rewritten once.
+  std::vector<std::string> files = compilation_database->getAllFiles();
+  std::vector<TranslationUnitResult> units(files.size());
+  std::vector<int> statuses(files.size());
+  std::vector<std::shared_future<void>> done;
+  llvm::ThreadPool pool(llvm::hardware_concurrency(jobs));
+  for (size_t i = 0; i < files.size(); i++) {
+    done.push_back(pool.async([&, i] {
+      std::vector<CompileCommand> commands =
+          compilation_database->getCompileCommands(files[i]);
+      if (commands.empty())
+        statuses[i] = 2;
+      else
+        statuses[i] =
+            instrument_translation_unit(files[i], commands[0], units[i]);
+    }));
+  }
 
-  // ClangTool::run accepts a FrontendActionFactory, which is then used to
-  // create new objects implementing the FrontendAction interface. Here we use
-  // the helper newFrontendActionFactory to create a default factory that will
-  // return a new MyFrontendAction object every time.
-  // To further customize this, we could create our own factory class.
-  int ret = Tool.run(newFrontendActionFactory<MyFrontendAction>().get());
+  int ret = 0;
+  for (size_t i = 0; i < files.size(); i++) {
+    done[i].wait();
+    merge_status(ret, statuses[i]);
+    if (!commit_translation_unit(units[i])) ret = 1;
+    units[i] = TranslationUnitResult();
 
-  std::ofstream varname(homedir() + "/variable_names.csv");
-  varname << "name,id" << std::endl;
-  for (const auto &it : varname_to_id) {
-    varname << it.first << "," << it.second << std::endl;
+    std::vector<CompileCommand> commands =
+        compilation_database->getCompileCommands(files[i]);
+    for (size_t c = 1; c < commands.size(); c++) {
+      TranslationUnitResult unit;
+      merge_status(ret,
+                   instrument_translation_unit(files[i], commands[c], unit));
+      if (!commit_translation_unit(unit)) ret = 1;
+    }
   }
-  varname.close();
 
+  if (!save_variable_ids(ids_path)) ret = 1;
+  if (!output_dir.empty() && !write_overlay()) ret = 1;
   return ret;
 }
+#endif  // SA4U_REWRITER_PLUGIN
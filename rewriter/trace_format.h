@@ -0,0 +1,171 @@
+/**
+ * On-disk layout of binary traces written by log_usage.cpp.
+ *
+ * A trace is a trace_file_header followed by segments, one per flush.
+ * Each segment is a trace_segment_header, an index of trace_index_entry
+ * (one per variable logged during the flush), and then data_size bytes
+ * holding the segment's records grouped by variable in index order. A
+ * segment is only valid if it lies entirely within the file; a torn last
+ * segment is ignored by readers. Segments start at multiples of 8 bytes,
+ * so that headers, index entries and raw records are aligned wherever
+ * the file is mapped: a compressed segment's data is zero padded to a
+ * multiple of 8 bytes, and data_size counts the padding.
+ *
+ * In a TRACE_ENCODING_RAW segment the data is an array of trace_record.
+ * In a TRACE_ENCODING_GORILLA segment each variable's records are a block
+ * compressed as in Facebook's Gorilla time series database: a bit stream,
+ * most significant bit first, padded to a whole byte. The first record is
+ * stored in full:
+ *
+ *   timestamp:64 bits:64 type:8 flags:8 sample_skip:32 repeats:32
+ *
+ * Each later record stores the delta of its timestamp delta (dod; the
+ * delta before the second record counts as 0), then its value XORed with
+ * the previous one (x), then its other fields if they changed:
+ *
+ *   dod   '0' if 0, else '10' + 16, '110' + 24, '1110' + 32 or '1111' + 64
+ *         bits of two's complement, using the shortest that fits
+ *   x     '0' if 0; '10' + the meaningful bits of x, if they fit within
+ *         the window of the previous '11' value; else '11' + 6 bits of
+ *         leading zeros + 6 bits of (meaningful bits - 1) + the bits
+ *   rest  '0' if type, flags, sample_skip and repeats are unchanged;
+ *         else '1' + type:8 flags:8 sample_skip:32 repeats:32
+ *
+ * All fixed width fields are little-endian.
+ */
+#ifndef SA4U_TRACE_FORMAT_H
+#define SA4U_TRACE_FORMAT_H
+
+#include <cstdint>
+#include <cstring>
+
+#define TRACE_MAGIC "SA4UTRC"
+#define TRACE_SEGMENT_MAGIC 0x4d474553u  // "SEGM"
+#define TRACE_FORMAT_VERSION 7
+
+// Scalar kinds, so readers can decode the raw bits of a value.
+enum trace_type : uint8_t {
+    TRACE_UNKNOWN = 0,
+    TRACE_INT8 = 1,
+    TRACE_INT16 = 2,
+    TRACE_INT32 = 3,
+    TRACE_INT64 = 4,
+    TRACE_FLOAT32 = 5,
+    TRACE_FLOAT64 = 6,
+    TRACE_UINT8 = 7,
+    TRACE_UINT16 = 8,
+    TRACE_UINT32 = 9,
+    TRACE_UINT64 = 10,
+};
+
+// Bits of trace_record::flags.
+enum trace_flag : uint8_t {
+    // The record is not a store. It reports that the variable's previous
+    // record, from the same thread, was followed by `repeats` stores that
+    // did not change its value (or stayed within its deadband), the last
+    // of them no later than the record's timestamp.
+    TRACE_FLAG_RUN = 1,
+};
+
+// How a segment's records are stored.
+enum trace_encoding : uint32_t {
+    TRACE_ENCODING_RAW = 0,
+    TRACE_ENCODING_GORILLA = 1,
+};
+
+struct trace_file_header {
+    char magic[8];          // TRACE_MAGIC, NUL terminated
+    uint32_t version;       // TRACE_FORMAT_VERSION
+    uint32_t header_size;   // sizeof(trace_file_header)
+    int64_t start_wall_ns;  // wall clock nanoseconds when the trace began
+};
+
+struct trace_segment_header {
+    uint32_t magic;         // TRACE_SEGMENT_MAGIC
+    uint32_t num_variables; // entries in the index that follows
+    uint64_t num_records;   // records in the segment's data
+    uint32_t encoding;      // trace_encoding
+    uint32_t reserved;
+    uint64_t data_size;     // bytes of data that follow the index
+};
+
+struct trace_index_entry {
+    uint32_t varid;
+    uint32_t block_size;        // gorilla: bytes in the variable's block; raw: 0
+    union {
+        uint64_t first_record;  // raw: index of the variable's first record
+                                // in the segment's records
+        uint64_t block_offset;  // gorilla: byte offset of the variable's
+                                // block in the segment's data
+    };
+    uint64_t num_records;
+};
+
+struct trace_record {
+    uint32_t varid;
+    uint8_t type;           // trace_type
+    uint8_t flags;          // trace_flag bits
+    uint16_t reserved;
+    uint32_t sample_skip;   // the store was logged with probability
+                            // 1 - sample_skip / 2^32; see trace_sample_rate
+    uint32_t repeats;       // for TRACE_FLAG_RUN records; otherwise 0
+    int64_t timestamp;      // monotonic nanoseconds since the trace began
+    uint64_t bits;          // the stored value, zero extended
+};
+
+static_assert(sizeof(trace_file_header) == 24, "trace_file_header layout changed");
+static_assert(sizeof(trace_segment_header) == 32, "trace_segment_header layout changed");
+static_assert(sizeof(trace_index_entry) == 24, "trace_index_entry layout changed");
+static_assert(sizeof(trace_record) == 32, "trace_record layout changed");
+
+// Returns the type tag for a store of size bytes of the given kind, where
+// floating is nonzero for floating point stores and is_signed is zero for
+// unsigned integers.
+static inline trace_type trace_type_of(int floating, unsigned long long size, int is_signed = 1) {
+    if (floating) {
+        if (size == sizeof(float)) return TRACE_FLOAT32;
+        if (size == sizeof(double)) return TRACE_FLOAT64;
+        return TRACE_UNKNOWN;
+    }
+    switch (size) {
+        case 1: return is_signed ? TRACE_INT8 : TRACE_UINT8;
+        case 2: return is_signed ? TRACE_INT16 : TRACE_UINT16;
+        case 4: return is_signed ? TRACE_INT32 : TRACE_UINT32;
+        case 8: return is_signed ? TRACE_INT64 : TRACE_UINT64;
+        default: return TRACE_UNKNOWN;
+    }
+}
+
+// Decodes the value of a record.
+static inline double trace_decode(uint8_t type, uint64_t bits) {
+    switch (type) {
+        case TRACE_INT8: return static_cast<int8_t>(bits);
+        case TRACE_INT16: return static_cast<int16_t>(bits);
+        case TRACE_INT32: return static_cast<int32_t>(bits);
+        case TRACE_INT64: return static_cast<int64_t>(bits);
+        case TRACE_UINT8: return static_cast<uint8_t>(bits);
+        case TRACE_UINT16: return static_cast<uint16_t>(bits);
+        case TRACE_UINT32: return static_cast<uint32_t>(bits);
+        case TRACE_UINT64: return static_cast<double>(bits);
+        case TRACE_FLOAT32: {
+            float f;
+            uint32_t b = static_cast<uint32_t>(bits);
+            memcpy(&f, &b, sizeof(f));
+            return f;
+        }
+        case TRACE_FLOAT64: {
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            return d;
+        }
+        default: return 0.0;
+    }
+}
+
+// Returns the probability with which a record's store was logged. A reader
+// can weight each record by its inverse to estimate the number of stores.
+static inline double trace_sample_rate(uint32_t sample_skip) {
+    return 1.0 - sample_skip / 4294967296.0;
+}
+
+#endif
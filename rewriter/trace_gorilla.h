@@ -0,0 +1,136 @@
+/**
+ * Encoder for TRACE_ENCODING_GORILLA blocks (see trace_format.h). The
+ * matching decoder is in trace_reader.cpp.
+ */
+#ifndef SA4U_TRACE_GORILLA_H
+#define SA4U_TRACE_GORILLA_H
+
+#include <cstdint>
+#include <string>
+
+#include "trace_format.h"
+
+// Appends bits to a string, most significant bit first.
+class trace_bit_writer {
+ public:
+    explicit trace_bit_writer(std::string &out) : out(out), acc(0), used(0) {}
+
+    // Appends the low n bits of value, for n from 1 to 64.
+    void write(uint64_t value, int n) {
+        if (n == 64) {
+            write(value >> 32, 32);
+            write(value & 0xffffffffu, 32);
+            return;
+        }
+        value &= (uint64_t(1) << n) - 1;
+        if (used + n < 64) {
+            acc = (acc << n) | value;
+            used += n;
+            return;
+        }
+        int rest = used + n - 64;
+        acc = (acc << (n - rest)) | (value >> rest);
+        put(acc, 8);
+        acc = value & ((uint64_t(1) << rest) - 1);
+        used = rest;
+    }
+
+    // Pads the stream to a whole byte and appends what is left of it.
+    void finish() {
+        int bytes = (used + 7) / 8;
+        put(acc << (bytes * 8 - used), bytes);
+        acc = 0;
+        used = 0;
+    }
+
+ private:
+    // Appends the low `bytes` bytes of word, most significant first.
+    void put(uint64_t word, int bytes) {
+        for (int i = bytes - 1; i >= 0; i--)
+            out.push_back(static_cast<char>(word >> (i * 8)));
+    }
+
+    std::string &out;
+    uint64_t acc;
+    int used;
+};
+
+// Encodes one variable's records, oldest first, into a block.
+class trace_gorilla_encoder {
+ public:
+    explicit trace_gorilla_encoder(std::string &out) : bits(out), count(0) {}
+
+    void add(const trace_record &r) {
+        if (count++ == 0) {
+            bits.write(r.timestamp, 64);
+            bits.write(r.bits, 64);
+            write_rest(r);
+            prev = r;
+            prev_delta = 0;
+            leading = trailing = 64;
+            return;
+        }
+
+        // Wrapping arithmetic, which the decoder's sums undo.
+        uint64_t delta = static_cast<uint64_t>(r.timestamp) - static_cast<uint64_t>(prev.timestamp);
+        write_dod(static_cast<int64_t>(delta - prev_delta));
+        prev_delta = delta;
+
+        write_xor(r.bits ^ prev.bits);
+
+        if (r.type == prev.type && r.flags == prev.flags && r.sample_skip == prev.sample_skip &&
+            r.repeats == prev.repeats) {
+            bits.write(0, 1);
+        } else {
+            bits.write(1, 1);
+            write_rest(r);
+        }
+        prev = r;
+    }
+
+    void finish() { bits.finish(); }
+
+ private:
+    void write_dod(int64_t dod) {
+        if (dod == 0) bits.write(0, 1);
+        else if (dod >= INT16_MIN && dod <= INT16_MAX) { bits.write(0x2, 2); bits.write(dod, 16); }
+        else if (dod >= -(1 << 23) && dod < (1 << 23)) { bits.write(0x6, 3); bits.write(dod, 24); }
+        else if (dod >= INT32_MIN && dod <= INT32_MAX) { bits.write(0xe, 4); bits.write(dod, 32); }
+        else { bits.write(0xf, 4); bits.write(dod, 64); }
+    }
+
+    void write_xor(uint64_t x) {
+        if (x == 0) {
+            bits.write(0, 1);
+            return;
+        }
+        int lead = __builtin_clzll(x), trail = __builtin_ctzll(x);
+        if (leading + trailing < 64 && lead >= leading && trail >= trailing) {
+            bits.write(0x2, 2);
+            bits.write(x >> trailing, 64 - leading - trailing);
+            return;
+        }
+        int meaningful = 64 - lead - trail;
+        bits.write(0x3, 2);
+        bits.write(lead, 6);
+        bits.write(meaningful - 1, 6);
+        bits.write(x >> trail, meaningful);
+        leading = lead;
+        trailing = trail;
+    }
+
+    void write_rest(const trace_record &r) {
+        bits.write(r.type, 8);
+        bits.write(r.flags, 8);
+        bits.write(r.sample_skip, 32);
+        bits.write(r.repeats, 32);
+    }
+
+    trace_bit_writer bits;
+    uint64_t count;
+    trace_record prev;
+    uint64_t prev_delta;
+    int leading, trailing;  // window of the last '11' value; empty at first
+};
+
+#endif
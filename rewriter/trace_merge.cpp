@@ -0,0 +1,244 @@
+/**
+ * Merges the traces of several runs (see SA4U_TRACE_PATH in log_usage.cpp)
+ * into one CSV, oldest reading first, with a run_id column naming the run
+ * each reading came from: its trace's file name, less any .csv or .trace
+ * extension. Timestamps are as each run recorded them, in nanoseconds
+ * since it began. Traces may be CSV or binary, in any mix.
+ *
+ * g++ -O2 -std=c++17 trace_merge.cpp trace_reader.cpp -o trace_merge
+ * ./trace_merge [--window ms] log.1234.csv log.1235.csv ... > merged.csv
+ *
+ * The merge streams: it holds one flush of a binary trace at a time, and
+ * otherwise only the readings of each trace within the reorder window of
+ * the newest it has read. A reading drained into a later flush than newer
+ * readings comes out in order if it is at most the window (default 1000
+ * ms) older than them; older ones are written as they come and counted.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "trace_reader.h"
+
+#define DEFAULT_WINDOW_MS 1000
+
+// One reading, with its value and the columns after it kept as text.
+struct merge_reading {
+    int64_t timestamp;
+    uint32_t varid;
+    uint64_t sequence;      // order read from its trace, to break ties
+    std::string rest;
+};
+
+struct later_reading {
+    bool operator()(const merge_reading &a, const merge_reading &b) const {
+        return a.timestamp != b.timestamp ? a.timestamp > b.timestamp : a.sequence > b.sequence;
+    }
+};
+
+// Readings of one trace, in the order they were written.
+class trace_source {
+ public:
+    virtual ~trace_source() {}
+
+    // Reads the next reading. Returns false at the end of the trace.
+    virtual bool next(merge_reading &out) = 0;
+};
+
+// A CSV trace, read a line at a time.
+class csv_source: public trace_source {
+ public:
+    explicit csv_source(FILE *in): in(in) {}
+    ~csv_source() { fclose(in); }
+
+    bool next(merge_reading &out) override {
+        while (getline(&line, &capacity, in) > 0) {
+            char *end;
+            unsigned long varid = strtoul(line, &end, 10);
+            if (end == line || *end != ',') continue;   // the header, or garbage
+            char *timestamp = end + 1;
+            long long ns = strtoll(timestamp, &end, 10);
+            if (end == timestamp || *end != ',') continue;
+            out.varid = varid;
+            out.timestamp = ns;
+            out.rest.assign(end + 1);
+            if (!out.rest.empty() && out.rest.back() == '\n') out.rest.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+ private:
+    FILE *in;
+    char *line = nullptr;
+    size_t capacity = 0;
+};
+
+// A binary trace, read a segment at a time. Each segment's records are
+// grouped by variable, so they are sorted before they are handed out.
+class binary_source: public trace_source {
+ public:
+    explicit binary_source(std::unique_ptr<trace_reader> reader, const std::string &path)
+        : reader(std::move(reader)), path(path) {}
+
+    bool next(merge_reading &out) override {
+        while (position == records.size()) {
+            if (segment == reader->segments().size()) return false;
+            load(reader->segments()[segment++]);
+        }
+        const trace_record &r = records[position++];
+        char rest[64];
+        snprintf(rest, sizeof(rest), "%g,%g,%u", trace_decode(r.type, r.bits), trace_sample_rate(r.sample_skip),
+                 r.repeats);
+        out.varid = r.varid;
+        out.timestamp = r.timestamp;
+        out.rest = rest;
+        return true;
+    }
+
+ private:
+    void load(const trace_segment &s) {
+        records.clear();
+        position = 0;
+        for (uint32_t v = 0; v < s.num_variables; v++) {
+            if (!trace_reader::read(s.span(v), records))
+                std::cerr << path << ": skipping a corrupt block for variable " << s.index[v].varid << std::endl;
+        }
+        std::stable_sort(records.begin(), records.end(), [](const trace_record &a, const trace_record &b) {
+            return a.timestamp < b.timestamp;
+        });
+    }
+
+    std::unique_ptr<trace_reader> reader;
+    std::string path;
+    size_t segment = 0;
+    std::vector<trace_record> records;
+    size_t position = 0;
+};
+
+// One run's readings, put in timestamp order within the reorder window.
+struct merge_input {
+    std::string run_id;
+    std::unique_ptr<trace_source> source;
+    std::priority_queue<merge_reading, std::vector<merge_reading>, later_reading> window;
+    int64_t newest = INT64_MIN;
+    int64_t last_written = INT64_MIN;
+    uint64_t sequence = 0;
+    uint64_t late = 0;
+    bool done = false;
+
+    // Reads until the oldest buffered reading is a window older than the
+    // newest read, or the trace ends. Returns false once it is drained.
+    bool fill(int64_t window_ns) {
+        while (!done && (window.empty() || newest - window.top().timestamp < window_ns)) {
+            merge_reading r;
+            if (!source->next(r)) {
+                done = true;
+                break;
+            }
+            r.sequence = sequence++;
+            newest = std::max(newest, r.timestamp);
+            window.push(std::move(r));
+        }
+        return !window.empty();
+    }
+};
+
+// Returns the run ID for a trace: its file name, less a .csv or .trace
+// extension.
+static std::string run_id_of(const std::string &path) {
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    for (const char *extension: {".csv", ".trace"}) {
+        size_t n = strlen(extension);
+        if (name.size() > n && name.compare(name.size() - n, n, extension) == 0)
+            return name.substr(0, name.size() - n);
+    }
+    return name;
+}
+
+// Opens a trace, binary or CSV. Returns nullptr on failure.
+static std::unique_ptr<trace_source> open_trace(const std::string &path) {
+    FILE *in = fopen(path.c_str(), "r");
+    if (!in) {
+        std::cerr << "cannot open " << path << ": " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+    char magic[sizeof(TRACE_MAGIC)] = {};
+    bool binary = fread(magic, 1, sizeof(magic), in) == sizeof(magic) && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+    if (!binary) {
+        rewind(in);
+        return std::unique_ptr<trace_source>(new csv_source(in));
+    }
+    fclose(in);
+
+    std::string error;
+    std::unique_ptr<trace_reader> reader = trace_reader::load(path, error);
+    if (!reader) {
+        std::cerr << error << std::endl;
+        return nullptr;
+    }
+    if (reader->truncated())
+        std::cerr << "warning: ignoring a partially written segment at the end of " << path << std::endl;
+    return std::unique_ptr<trace_source>(new binary_source(std::move(reader), path));
+}
+
+int main(int argc, const char **argv) {
+    int64_t window_ns = DEFAULT_WINDOW_MS * 1000000ll;
+    int first = 1;
+    if (argc > 2 && std::string(argv[1]) == "--window") {
+        window_ns = strtoll(argv[2], nullptr, 10) * 1000000ll;
+        first = 3;
+    }
+    if (first >= argc || window_ns < 0) {
+        std::cerr << "usage: " << argv[0] << " [--window ms] [trace] [trace ...]" << std::endl;
+        return 1;
+    }
+
+    std::vector<merge_input> inputs(argc - first);
+    for (int i = first; i < argc; i++) {
+        merge_input &input = inputs[i - first];
+        input.run_id = run_id_of(argv[i]);
+        input.source = open_trace(argv[i]);
+        if (!input.source) return 1;
+    }
+
+    static char buffer[1 << 20];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+    printf("run_id,variable_id,timestamp_ns,value,sample_rate,repeats\n");
+
+    // Inputs by their oldest buffered reading; ties go to the first input.
+    auto later = [&](size_t a, size_t b) {
+        int64_t ta = inputs[a].window.top().timestamp, tb = inputs[b].window.top().timestamp;
+        return ta != tb ? ta > tb : a > b;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heads(later);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (inputs[i].fill(window_ns)) heads.push(i);
+    }
+    while (!heads.empty()) {
+        size_t i = heads.top();
+        heads.pop();
+        merge_input &input = inputs[i];
+        const merge_reading &r = input.window.top();
+        if (r.timestamp < input.last_written) input.late++;
+        input.last_written = std::max(input.last_written, r.timestamp);
+        printf("%s,%u,%lld,%s\n", input.run_id.c_str(), r.varid, static_cast<long long>(r.timestamp), r.rest.c_str());
+        input.window.pop();
+        if (input.fill(window_ns)) heads.push(i);
+    }
+
+    for (const merge_input &input: inputs) {
+        if (input.late) {
+            std::cerr << "warning: " << input.late << " readings of " << input.run_id
+                      << " were more than the window older than readings before them" << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * Layout of the crash-safe ring file log_usage.cpp keeps when
+ * SA4U_TRACE_PERSIST names one.
+ *
+ * The file is a trace_persist_header followed by num_regions regions. Each
+ * instrumented thread claims a region and uses its records as the ring
+ * log_usage writes readings into, so readings are in the file's shared
+ * mapping from the moment they are logged and survive the process dying
+ * at any point. A ring holds the last ring_capacity readings of its thread;
+ * reading p lives in record p % ring_capacity of the region.
+ *
+ * Every drain pass, the collector moves each region's `committed` offset
+ * up to the readings it has drained. Readings before it are complete. A
+ * reading after it may be torn, so log_usage stamps each record's
+ * `reserved` field with trace_persist_check of the record and its
+ * position, and recovery accepts readings past the committed offset only
+ * up to the first that fails the check. Once the writer has appended
+ * readings to the trace, it moves `flushed` past them, so recovery only
+ * returns what the trace is missing.
+ *
+ * Timestamps are raw clock readings (see log_usage_clock); the header's
+ * calibration converts them to nanoseconds since the trace began.
+ */
+#ifndef SA4U_TRACE_PERSIST_H
+#define SA4U_TRACE_PERSIST_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include "trace_format.h"
+
+#define TRACE_PERSIST_MAGIC "SA4UPST"
+#define TRACE_PERSIST_VERSION 2
+
+struct trace_persist_header {
+    char magic[8];                          // TRACE_PERSIST_MAGIC, NUL terminated
+    uint32_t version;                       // TRACE_PERSIST_VERSION
+    uint32_t header_size;                   // sizeof(trace_persist_header)
+    uint32_t ring_capacity;                 // records per region, a power of two
+    uint32_t num_regions;
+    std::atomic<uint32_t> regions_used;     // regions claimed by threads so far
+    uint32_t reserved;
+    int64_t start_wall_ns;                  // wall clock nanoseconds when the trace began
+
+    // ns since the trace began = calibration_ns + (raw - calibration_raw) * ns_per_tick.
+    // Odd calibration_seq means an update was in progress.
+    std::atomic<uint64_t> calibration_seq;
+    uint64_t calibration_raw;
+    int64_t calibration_ns;
+    double ns_per_tick;
+};
+
+struct trace_persist_region {
+    std::atomic<uint64_t> committed;        // readings before this are complete
+    std::atomic<uint64_t> flushed;          // readings before this are in the trace
+    uint32_t tid;                           // the thread that claimed the region
+    uint32_t reserved[11];
+    // Followed by the ring's ring_capacity trace_records.
+};
+
+static_assert(sizeof(trace_persist_header) == 72, "trace_persist_header layout changed");
+static_assert(sizeof(trace_persist_region) == 64, "trace_persist_region layout changed");
+
+static inline size_t trace_persist_region_size(uint32_t ring_capacity) {
+    return sizeof(trace_persist_region) + static_cast<size_t>(ring_capacity) * sizeof(trace_record);
+}
+
+static inline trace_persist_region *trace_persist_region_at(trace_persist_header *header, uint32_t i) {
+    return reinterpret_cast<trace_persist_region*>(reinterpret_cast<char*>(header) + header->header_size +
+                                                   i * trace_persist_region_size(header->ring_capacity));
+}
+
+static inline trace_record *trace_persist_records(trace_persist_region *region) {
+    return reinterpret_cast<trace_record*>(region + 1);
+}
+
+// Returns the check for a record logged at position. Every field but
+// `reserved`, which holds the check, contributes.
+static inline uint16_t trace_persist_check(const trace_record &r, uint64_t position) {
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t h = (position + 1) * k;
+    h = (h ^ (uint64_t(r.varid) << 32 | uint64_t(r.type) << 8 | r.flags)) * k;
+    h = (h ^ (uint64_t(r.sample_skip) << 32 | r.repeats)) * k;
+    h = (h ^ static_cast<uint64_t>(r.timestamp)) * k;
+    h = (h ^ r.bits) * k;
+    return static_cast<uint16_t>(h >> 48);
+}
+
+// Converts a raw timestamp with the header's calibration.
+static inline int64_t trace_persist_ns(const trace_persist_header &header, uint64_t raw) {
+    int64_t ticks = static_cast<int64_t>(raw - header.calibration_raw);
+    return header.calibration_ns + llround(ticks * header.ns_per_tick);
+}
+
+#endif
@@ -0,0 +1,346 @@
+#include "trace_reader.h"
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(__AVX2__) || (defined(__SSE2__) && defined(__x86_64__))
+#include <immintrin.h>
+#endif
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+std::unique_ptr<trace_reader> trace_reader::load(const std::string &path, std::string &error) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "cannot open " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        error = "cannot stat " + path + ": " + strerror(errno);
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = st.st_size;
+    if (size < sizeof(trace_file_header)) {
+        error = path + " is too short to be a trace";
+        close(fd);
+        return nullptr;
+    }
+
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        error = "cannot map " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    std::unique_ptr<trace_reader> reader(new trace_reader(static_cast<const char*>(data), size));
+    if (!reader->index(error)) {
+        error = path + ": " + error;
+        return nullptr;
+    }
+    return reader;
+}
+
+trace_reader::trace_reader(const char *data, size_t size)
+    : data(data), size(size), file_header(reinterpret_cast<const trace_file_header*>(data)),
+      total_records(0), has_torn_tail(false) {}
+
+trace_reader::~trace_reader() {
+    munmap(const_cast<char*>(data), size);
+}
+
+bool trace_reader::index(std::string &error) {
+    if (memcmp(file_header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        error = "not a binary trace";
+        return false;
+    }
+    if (file_header->version != TRACE_FORMAT_VERSION) {
+        error = "unsupported trace version " + std::to_string(file_header->version);
+        return false;
+    }
+
+    size_t offset = file_header->header_size;
+    while (offset < size) {
+        if (size - offset < sizeof(trace_segment_header)) {
+            has_torn_tail = true;
+            break;
+        }
+        if (offset % alignof(trace_record) != 0) {
+            error = "misaligned segment " + std::to_string(all_segments.size());
+            return false;
+        }
+        const trace_segment_header *header = reinterpret_cast<const trace_segment_header*>(data + offset);
+        if (header->magic != TRACE_SEGMENT_MAGIC) {
+            has_torn_tail = true;
+            break;
+        }
+
+        size_t index_size = static_cast<size_t>(header->num_variables) * sizeof(trace_index_entry);
+        size_t remaining = size - offset - sizeof(trace_segment_header);
+        if (index_size > remaining || header->data_size > remaining - index_size) {
+            has_torn_tail = true;
+            break;
+        }
+
+        std::string corrupt = "corrupt index in segment " + std::to_string(all_segments.size());
+        bool raw = header->encoding == TRACE_ENCODING_RAW;
+        if (!raw && header->encoding != TRACE_ENCODING_GORILLA) {
+            error = "unknown encoding in segment " + std::to_string(all_segments.size());
+            return false;
+        }
+        if (raw && header->data_size != header->num_records * sizeof(trace_record)) {
+            error = corrupt;
+            return false;
+        }
+
+        trace_segment segment;
+        segment.index = reinterpret_cast<const trace_index_entry*>(data + offset + sizeof(trace_segment_header));
+        segment.num_variables = header->num_variables;
+        segment.encoding = header->encoding;
+        segment.data = reinterpret_cast<const uint8_t*>(data + offset + sizeof(trace_segment_header) + index_size);
+        segment.records = raw ? reinterpret_cast<const trace_record*>(segment.data) : nullptr;
+        segment.num_records = header->num_records;
+
+        for (uint32_t i = 0; i < segment.num_variables; i++) {
+            const trace_index_entry &entry = segment.index[i];
+            uint64_t limit = raw ? segment.num_records : header->data_size;
+            uint64_t start = raw ? entry.first_record : entry.block_offset;
+            uint64_t length = raw ? entry.num_records : entry.block_size;
+            if (start > limit || length > limit - start ||
+                entry.num_records > segment.num_records) {
+                error = corrupt;
+                return false;
+            }
+            spans[entry.varid].push_back(segment.span(i));
+        }
+
+        all_segments.push_back(segment);
+        total_records += segment.num_records;
+        offset += sizeof(trace_segment_header) + index_size + header->data_size;
+    }
+    return true;
+}
+
+const std::vector<trace_span> &trace_reader::variable(uint32_t varid) const {
+    static const std::vector<trace_span> empty;
+    auto it = spans.find(varid);
+    return it == spans.end() ? empty : it->second;
+}
+
+std::vector<uint32_t> trace_reader::variables() const {
+    std::vector<uint32_t> result;
+    result.reserve(spans.size());
+    for (const auto &pair: spans)
+        result.push_back(pair.first);
+    return result;
+}
+
+namespace {
+
+// Reads a bit stream written by trace_bit_writer.
+class bit_reader {
+ public:
+    bit_reader(const uint8_t *data, size_t size) : data(data), size(size), pos(0), ok(true) {}
+
+    // Returns the next n bits, for n from 1 to 64. Past the end of the
+    // stream, returns 0 and clears ok.
+    uint64_t read(int n) {
+        if (n > 32) {
+            uint64_t high = read(n - 32);
+            return (high << 32) | read(32);
+        }
+        if (size * 8 - pos < static_cast<size_t>(n)) {
+            ok = false;
+            return 0;
+        }
+        size_t byte = pos / 8;
+        uint64_t word = 0;
+        if (size - byte >= sizeof(word)) {
+            memcpy(&word, data + byte, sizeof(word));
+            word = __builtin_bswap64(word);
+        } else {
+            for (size_t i = 0; i < sizeof(word); i++)
+                word = (word << 8) | (byte + i < size ? data[byte + i] : 0);
+        }
+        word <<= pos % 8;
+        pos += n;
+        return word >> (64 - n);
+    }
+
+    // Returns the number of leading 1 bits, reading at most max of them
+    // and the 0 that ends them.
+    int ones(int max) {
+        int n = 0;
+        while (n < max && read(1)) n++;
+        return n;
+    }
+
+    bool good() const { return ok; }
+
+ private:
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    bool ok;
+};
+
+// Sign extends the low n bits of value.
+int64_t sign_extend(uint64_t value, int n) {
+    return n == 64 ? static_cast<int64_t>(value) : static_cast<int64_t>(value << (64 - n)) >> (64 - n);
+}
+
+// Replaces each v[i] with v[0] + ... + v[i].
+void prefix_sum(uint64_t *v, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i carry = _mm256_setzero_si256();
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i));
+        x = _mm256_add_epi64(x, _mm256_slli_si256(x, 8));  // a, a+b, c, c+d
+        __m256i low = _mm256_permute4x64_epi64(x, 0x55);
+        x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_setzero_si256(), low, 0xf0));
+        x = _mm256_add_epi64(x, carry);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(v + i), x);
+        carry = _mm256_permute4x64_epi64(x, 0xff);
+    }
+#elif defined(__SSE2__) && defined(__x86_64__)
+    __m128i carry = _mm_setzero_si128();
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i));
+        x = _mm_add_epi64(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi64(x, carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(v + i), x);
+        carry = _mm_shuffle_epi32(x, 0xee);
+    }
+#endif
+    uint64_t sum = i ? v[i - 1] : 0;
+    for (; i < n; i++)
+        v[i] = sum += v[i];
+}
+
+// Replaces each v[i] with v[0] ^ ... ^ v[i].
+void prefix_xor(uint64_t *v, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i carry = _mm256_setzero_si256();
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i));
+        x = _mm256_xor_si256(x, _mm256_slli_si256(x, 8));
+        __m256i low = _mm256_permute4x64_epi64(x, 0x55);
+        x = _mm256_xor_si256(x, _mm256_blend_epi32(_mm256_setzero_si256(), low, 0xf0));
+        x = _mm256_xor_si256(x, carry);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(v + i), x);
+        carry = _mm256_permute4x64_epi64(x, 0xff);
+    }
+#elif defined(__SSE2__) && defined(__x86_64__)
+    __m128i carry = _mm_setzero_si128();
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i));
+        x = _mm_xor_si128(x, _mm_slli_si128(x, 8));
+        x = _mm_xor_si128(x, carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(v + i), x);
+        carry = _mm_shuffle_epi32(x, 0xee);
+    }
+#endif
+    uint64_t acc = i ? v[i - 1] : 0;
+    for (; i < n; i++)
+        v[i] = acc ^= v[i];
+}
+
+// Reads the fields that trace_gorilla_encoder::write_rest wrote.
+void read_rest(bit_reader &bits, trace_record &r) {
+    r.type = bits.read(8);
+    r.flags = bits.read(8);
+    r.sample_skip = bits.read(32);
+    r.repeats = bits.read(32);
+}
+
+// Appends the records of a TRACE_ENCODING_GORILLA block to out. The bit
+// stream is parsed serially into deltas of deltas and XORs, which are
+// then turned back into timestamps and values with vectorized scans.
+bool decode_gorilla(const trace_span &span, std::vector<trace_record> &out) {
+    static const int dod_widths[] = {16, 24, 32, 64};
+    size_t n = span.num_records;
+    if (n == 0) return true;
+
+    size_t base = out.size();
+    out.resize(base + n);
+    trace_record *records = out.data() + base;
+    std::vector<uint64_t> times(n), values(n);
+
+    bit_reader bits(span.block, span.block_size);
+    trace_record prev;
+    memset(&prev, 0, sizeof(prev));
+    prev.varid = span.varid;
+    times[0] = bits.read(64);
+    values[0] = bits.read(64);
+    read_rest(bits, prev);
+    records[0] = prev;
+
+    int leading = 0, meaningful = 0;
+    for (size_t i = 1; i < n && bits.good(); i++) {
+        int prefix = bits.ones(4);
+        if (prefix == 0) {
+            times[i] = 0;
+        } else {
+            int width = dod_widths[prefix - 1];
+            times[i] = sign_extend(bits.read(width), width);
+        }
+
+        if (!bits.read(1)) {
+            values[i] = 0;
+        } else {
+            if (bits.read(1)) {
+                leading = bits.read(6);
+                meaningful = bits.read(6) + 1;
+                if (leading + meaningful > 64) return false;
+            } else if (meaningful == 0) {
+                return false;
+            }
+            values[i] = bits.read(meaningful) << (64 - leading - meaningful);
+        }
+
+        if (bits.read(1)) read_rest(bits, prev);
+        records[i] = prev;
+    }
+    if (!bits.good()) return false;
+
+    // times holds the first timestamp and then deltas of deltas. Summing
+    // from the second entry gives the deltas, and summing again from the
+    // first gives the timestamps.
+    uint64_t first = times[0];
+    times[0] = 0;
+    prefix_sum(times.data(), n);
+    times[0] = first;
+    prefix_sum(times.data(), n);
+    prefix_xor(values.data(), n);
+
+    for (size_t i = 0; i < n; i++) {
+        records[i].timestamp = times[i];
+        records[i].bits = values[i];
+    }
+    return true;
+}
+
+}  // namespace
+
+bool trace_reader::read(const trace_span &span, std::vector<trace_record> &out) {
+    if (span.records) {
+        out.insert(out.end(), span.records, span.records + span.num_records);
+        return true;
+    }
+    size_t base = out.size();
+    if (decode_gorilla(span, out)) return true;
+    out.resize(base);
+    return false;
+}
@@ -0,0 +1,93 @@
+/**
+ * Memory-mapped reader for binary traces (see trace_format.h).
+ *
+ * Loading a trace only walks the segment headers and indexes. Records of
+ * raw segments are read in place from the mapping; compressed ones are
+ * decoded by trace_reader::read.
+ */
+#ifndef SA4U_TRACE_READER_H
+#define SA4U_TRACE_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "trace_format.h"
+
+// A run of consecutive records for one variable within one segment.
+struct trace_span {
+    uint32_t varid;
+    const trace_record *records;  // raw segments; nullptr if compressed
+    const uint8_t *block;         // compressed segments; nullptr if raw
+    size_t block_size;
+    uint64_t num_records;
+};
+
+// A segment as it lies in the mapping.
+struct trace_segment {
+    const trace_index_entry *index;
+    uint32_t num_variables;
+    uint32_t encoding;            // trace_encoding
+    const trace_record *records;  // raw segments; nullptr if compressed
+    const uint8_t *data;
+    uint64_t num_records;
+
+    // Returns the span of the i-th variable in the index.
+    trace_span span(uint32_t i) const {
+        const trace_index_entry &entry = index[i];
+        if (encoding == TRACE_ENCODING_RAW)
+            return {entry.varid, records + entry.first_record, nullptr, 0, entry.num_records};
+        return {entry.varid, nullptr, data + entry.block_offset, entry.block_size, entry.num_records};
+    }
+};
+
+class trace_reader {
+ public:
+    // Maps the trace at path. Returns nullptr and sets error on failure.
+    static std::unique_ptr<trace_reader> load(const std::string &path, std::string &error);
+
+    ~trace_reader();
+
+    trace_reader(const trace_reader &) = delete;
+    trace_reader &operator=(const trace_reader &) = delete;
+
+    const trace_file_header &header() const { return *file_header; }
+
+    // Segments in the order they were flushed.
+    const std::vector<trace_segment> &segments() const { return all_segments; }
+
+    // Returns the spans holding a variable's records, oldest first.
+    const std::vector<trace_span> &variable(uint32_t varid) const;
+
+    // Appends a span's records to out, decoding them if the span is
+    // compressed. Returns false if the span's block is corrupt.
+    static bool read(const trace_span &span, std::vector<trace_record> &out);
+
+    // Returns the IDs of every variable with at least one record.
+    std::vector<uint32_t> variables() const;
+
+    // Total records across all valid segments.
+    uint64_t num_records() const { return total_records; }
+
+    // True if the file ends with a partially written segment.
+    bool truncated() const { return has_torn_tail; }
+
+ private:
+    trace_reader(const char *data, size_t size);
+
+    // Walks and validates the segments. Returns false if the header is bad.
+    bool index(std::string &error);
+
+    const char *data;
+    size_t size;
+    const trace_file_header *file_header;
+    std::vector<trace_segment> all_segments;
+    std::unordered_map<uint32_t, std::vector<trace_span>> spans;
+    uint64_t total_records;
+    bool has_torn_tail;
+};
+
+#endif
@@ -0,0 +1,133 @@
+/**
+ * Recovers the readings a crashed process had not yet appended to its
+ * trace from its ring file (see trace_persist.h), and prints them as the
+ * CSV that log_csv.py reads, oldest first.
+ *
+ * g++ -O2 -std=c++17 trace_recover.cpp -o trace_recover
+ * ./trace_recover ring.persist [--truncate] > recovered.csv
+ *
+ * With --truncate, each region's committed offset is moved to the end of
+ * its valid readings, dropping its torn tail for later readers.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "trace_persist.h"
+
+static bool valid(const trace_record &r, uint64_t position) {
+    return r.reserved == trace_persist_check(r, position);
+}
+
+// True if the slot that reading `position` goes in holds neither that
+// reading nor what was there before it: the reading was being written.
+static bool torn(const trace_record &r, uint64_t position, uint32_t capacity) {
+    static const trace_record unwritten = {};
+    if (position < capacity) return memcmp(&r, &unwritten, sizeof(r)) != 0;
+    return !valid(r, position - capacity);
+}
+
+int main(int argc, const char **argv) {
+    bool truncate = argc == 3 && std::string(argv[2]) == "--truncate";
+    if (argc != 2 && !truncate) {
+        std::cerr << "usage: " << argv[0] << " [path to ring file] [--truncate]" << std::endl;
+        return 1;
+    }
+
+    int fd = open(argv[1], truncate ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "cannot open " << argv[1] << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(trace_persist_header)) {
+        std::cerr << argv[1] << " is too short to be a ring file" << std::endl;
+        return 1;
+    }
+    void *data = mmap(nullptr, size, truncate ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "cannot map " << argv[1] << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    auto *header = static_cast<trace_persist_header*>(data);
+    uint32_t capacity = header->ring_capacity;
+    if (memcmp(header->magic, TRACE_PERSIST_MAGIC, sizeof(TRACE_PERSIST_MAGIC)) != 0 ||
+        header->version != TRACE_PERSIST_VERSION || header->header_size != sizeof(trace_persist_header) ||
+        capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+        header->header_size + header->num_regions * trace_persist_region_size(capacity) > size) {
+        std::cerr << argv[1] << " is not a version " << TRACE_PERSIST_VERSION << " ring file" << std::endl;
+        return 1;
+    }
+    if (header->calibration_seq.load(std::memory_order_acquire) & 1)
+        std::cerr << "warning: the clock calibration was being updated; timestamps may be off" << std::endl;
+
+    std::vector<trace_record> recovered;
+    uint32_t used = std::min(header->regions_used.load(std::memory_order_relaxed), header->num_regions);
+    for (uint32_t i = 0; i < used; i++) {
+        trace_persist_region *region = trace_persist_region_at(header, i);
+        const trace_record *records = trace_persist_records(region);
+        uint64_t committed = region->committed.load(std::memory_order_acquire);
+        uint64_t flushed = std::min(region->flushed.load(std::memory_order_acquire), committed);
+
+        // Readings past the committed offset count up to the first torn one.
+        uint64_t end = committed;
+        while (end - committed < capacity && valid(records[end & (capacity - 1)], end))
+            end++;
+        bool has_torn_tail = end - committed < capacity && torn(records[end & (capacity - 1)], end, capacity);
+
+        // A torn reading overwrote the oldest one, so that slot is left out.
+        uint64_t limit = end + (has_torn_tail ? 1 : 0);
+        uint64_t oldest = limit > capacity ? limit - capacity : 0;
+        uint64_t start = std::max(flushed, oldest);
+
+        unsigned long long corrupt = 0;
+        for (uint64_t p = start; p < end; p++) {
+            trace_record r = records[p & (capacity - 1)];
+            if (!valid(r, p)) {
+                corrupt++;
+                continue;
+            }
+            r.timestamp = trace_persist_ns(*header, r.timestamp);
+            recovered.push_back(r);
+        }
+
+        std::cerr << "region " << i << " (thread " << region->tid << "): recovered " << end - start - corrupt
+                  << " readings, " << end - committed << " of them past the committed offset";
+        if (flushed < oldest)
+            std::cerr << "; " << oldest - flushed << " unflushed readings were overwritten";
+        if (corrupt)
+            std::cerr << "; " << corrupt << " corrupt readings skipped";
+        if (has_torn_tail)
+            std::cerr << "; dropped a torn reading";
+        std::cerr << std::endl;
+
+        if (truncate) {
+            region->committed.store(end, std::memory_order_release);
+            msync(region, sizeof(*region), MS_SYNC);
+        }
+    }
+
+    std::stable_sort(recovered.begin(), recovered.end(), [](const trace_record &a, const trace_record &b) {
+        return a.timestamp < b.timestamp;
+    });
+    printf("variable_id,timestamp_ns,value,sample_rate,repeats\n");
+    for (const trace_record &r: recovered) {
+        printf("%u,%lld,%g,%g,%u\n", r.varid, static_cast<long long>(r.timestamp), trace_decode(r.type, r.bits),
+               trace_sample_rate(r.sample_skip), r.repeats);
+    }
+    return 0;
+}
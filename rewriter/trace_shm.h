@@ -0,0 +1,201 @@
+/**
+ * Layout of the live trace stream log_usage.cpp publishes to POSIX shared
+ * memory when SA4U_TRACE_SHM names a segment (e.g. "/sa4u").
+ *
+ * The segment is a trace_shm_header followed by `capacity` trace_shm_slots,
+ * where capacity is a power of two. Every record ever published has a
+ * position, claimed from `head`; position p lives in slot p % capacity.
+ * Each slot's sequence is 0 until first written, 2p + 1 while position p
+ * is being written and 2p + 2 once it is complete.
+ *
+ * Any number of processes may publish into one segment (each process's
+ * collector thread is a producer). A single consumer follows positions
+ * from wherever it starts. The ring never waits for the consumer: once a
+ * consumer falls more than capacity records behind `head`, the oldest
+ * records are overwritten and it skips ahead past them (see
+ * trace_shm_read).
+ *
+ * Records are trace_records (see trace_format.h), except that timestamps
+ * are CLOCK_MONOTONIC nanoseconds, so that records from different
+ * processes can be compared.
+ */
+#ifndef SA4U_TRACE_SHM_H
+#define SA4U_TRACE_SHM_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+extern "C" {
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "trace_format.h"
+
+#define TRACE_SHM_MAGIC "SA4USHM"
+#define TRACE_SHM_VERSION 2
+
+// How many times a producer retries a slot another producer is still
+// writing before giving its record up. Bounds the wait if a producer died
+// mid-write.
+#define TRACE_SHM_MAX_SPINS 1000
+
+struct trace_shm_header {
+    char magic[8];                      // TRACE_SHM_MAGIC, NUL terminated
+    std::atomic<uint32_t> version;      // TRACE_SHM_VERSION once initialized
+    uint32_t header_size;               // sizeof(trace_shm_header)
+    uint64_t capacity;                  // number of slots, a power of two
+    uint64_t slot_size;                 // sizeof(trace_shm_slot)
+    alignas(64) std::atomic<uint64_t> head;  // next position to claim
+    std::atomic<uint64_t> dropped;      // records producers gave up on
+};
+
+struct trace_shm_slot {
+    std::atomic<uint64_t> sequence;
+    uint32_t pid;                       // the publishing process
+    uint32_t reserved;
+    trace_record record;
+};
+
+static_assert(sizeof(trace_shm_header) == 128, "trace_shm_header layout changed");
+static_assert(sizeof(trace_shm_slot) == 48, "trace_shm_slot layout changed");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory counters must be lock free");
+
+static inline trace_shm_slot *trace_shm_slots(trace_shm_header *header) {
+    return reinterpret_cast<trace_shm_slot*>(reinterpret_cast<char*>(header) + header->header_size);
+}
+
+static inline size_t trace_shm_size(uint64_t capacity) {
+    return sizeof(trace_shm_header) + capacity * sizeof(trace_shm_slot);
+}
+
+// Maps the segment called name, creating it with capacity slots (rounded
+// up to a power of two) if it does not exist and create is set. Returns
+// nullptr and sets error on failure.
+static inline trace_shm_header *trace_shm_attach(const std::string &name, uint64_t capacity, bool create,
+                                                 std::string &error) {
+    uint64_t slots = 1;
+    while (slots < capacity) slots <<= 1;
+
+    bool created = false;
+    int fd = create ? shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644) : -1;
+    if (fd >= 0) {
+        created = true;
+        if (ftruncate(fd, trace_shm_size(slots)) != 0) {
+            error = "cannot size " + name + ": " + strerror(errno);
+            close(fd);
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+    } else if (!create || errno == EEXIST) {
+        fd = shm_open(name.c_str(), O_RDWR, 0);
+    }
+    if (fd < 0) {
+        error = "cannot open " + name + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    // Another process may have created the segment and not sized it yet.
+    struct stat st;
+    for (int tries = 0; fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) < sizeof(trace_shm_header); tries++) {
+        if (tries == 1000) break;
+        usleep(1000);
+    }
+    if (static_cast<size_t>(st.st_size) < sizeof(trace_shm_header)) {
+        error = name + " is not a trace stream";
+        close(fd);
+        return nullptr;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        error = "cannot map " + name + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    trace_shm_header *header = static_cast<trace_shm_header*>(data);
+    if (created) {
+        // The mapping starts zeroed, so every slot is already unwritten.
+        memcpy(header->magic, TRACE_SHM_MAGIC, sizeof(TRACE_SHM_MAGIC));
+        header->header_size = sizeof(trace_shm_header);
+        header->capacity = slots;
+        header->slot_size = sizeof(trace_shm_slot);
+        header->version.store(TRACE_SHM_VERSION, std::memory_order_release);
+        return header;
+    }
+
+    for (int tries = 0; header->version.load(std::memory_order_acquire) == 0 && tries < 1000; tries++)
+        usleep(1000);
+    if (memcmp(header->magic, TRACE_SHM_MAGIC, sizeof(TRACE_SHM_MAGIC)) != 0 ||
+        header->version.load(std::memory_order_acquire) != TRACE_SHM_VERSION ||
+        header->slot_size != sizeof(trace_shm_slot) ||
+        trace_shm_size(header->capacity) > static_cast<size_t>(st.st_size)) {
+        error = name + " is not a version " + std::to_string(TRACE_SHM_VERSION) + " trace stream";
+        munmap(data, st.st_size);
+        return nullptr;
+    }
+    return header;
+}
+
+// Publishes a record, overwriting the oldest one if the ring is full.
+static inline void trace_shm_publish(trace_shm_header *header, uint32_t pid, const trace_record &record) {
+    uint64_t pos = header->head.fetch_add(1, std::memory_order_relaxed);
+    trace_shm_slot &slot = trace_shm_slots(header)[pos & (header->capacity - 1)];
+
+    // Take the slot, unless a producer from a later lap already has.
+    uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    for (int spins = 0;; spins++) {
+        if (sequence >= 2 * pos + 1 || spins == TRACE_SHM_MAX_SPINS) {
+            header->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (sequence & 1) {
+            sched_yield();
+            sequence = slot.sequence.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (slot.sequence.compare_exchange_weak(sequence, 2 * pos + 1, std::memory_order_relaxed))
+            break;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.pid = pid;
+    slot.record = record;
+    slot.sequence.store(2 * pos + 2, std::memory_order_release);
+}
+
+enum trace_shm_status {
+    TRACE_SHM_READY,        // the record at the position was copied out
+    TRACE_SHM_PENDING,      // the position is not published yet, or its
+                            // producer is still writing it
+    TRACE_SHM_OVERWRITTEN,  // the position was overwritten; skip ahead
+};
+
+// Copies out the record at position pos. On TRACE_SHM_OVERWRITTEN, pos is
+// moved to the oldest position that may still be in the ring.
+static inline trace_shm_status trace_shm_read(trace_shm_header *header, uint64_t &pos, uint32_t &pid,
+                                              trace_record &record) {
+    trace_shm_slot &slot = trace_shm_slots(header)[pos & (header->capacity - 1)];
+    uint64_t before = slot.sequence.load(std::memory_order_acquire);
+    if (before == 2 * pos + 2) {
+        pid = slot.pid;
+        record = slot.record;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) == before) return TRACE_SHM_READY;
+    } else if (before <= 2 * pos + 1) {
+        return TRACE_SHM_PENDING;
+    }
+
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    uint64_t oldest = head > header->capacity ? head - header->capacity : 0;
+    pos = oldest > pos ? oldest : pos + 1;
+    return TRACE_SHM_OVERWRITTEN;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/**
+ * Follows the live stream that instrumented processes publish to shared
+ * memory (see trace_shm.h), printing each record as CSV as it arrives.
+ *
+ * g++ -O2 -std=c++17 trace_shm_tail.cpp -o trace_shm_tail
+ * SA4U_TRACE_SHM=/sa4u ./instrumented &
+ * ./trace_shm_tail /sa4u [--from-oldest]
+ */
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "trace_shm.h"
+
+// How long to wait on a position that later ones have overtaken before
+// deciding its producer died while writing it.
+#define STUCK_TIMEOUT_MS 1000
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int) {
+    stop = 1;
+}
+
+int main(int argc, const char **argv) {
+    if (argc < 2 || argc > 3 || (argc == 3 && std::string(argv[2]) != "--from-oldest")) {
+        std::cerr << "usage: " << argv[0] << " [shared memory name] [--from-oldest]" << std::endl;
+        return 1;
+    }
+
+    std::string error;
+    trace_shm_header *header = trace_shm_attach(argv[1], 0, false, error);
+    if (!header) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    uint64_t pos = head;
+    if (argc == 3) pos = head > header->capacity ? head - header->capacity : 0;
+
+    printf("pid,variable_id,timestamp_ns,value,sample_rate,repeats\n");
+    unsigned long long lost = 0;
+    auto stuck_since = std::chrono::steady_clock::time_point::max();
+    while (!stop) {
+        uint32_t pid;
+        trace_record r;
+        uint64_t before = pos;
+        switch (trace_shm_read(header, pos, pid, r)) {
+            case TRACE_SHM_READY:
+                printf("%u,%u,%lld,%g,%g,%u\n", pid, r.varid, static_cast<long long>(r.timestamp),
+                       trace_decode(r.type, r.bits), trace_sample_rate(r.sample_skip), r.repeats);
+                pos++;
+                stuck_since = std::chrono::steady_clock::time_point::max();
+                break;
+            case TRACE_SHM_OVERWRITTEN:
+                lost += pos - before;
+                break;
+            case TRACE_SHM_PENDING: {
+                fflush(stdout);
+                auto now = std::chrono::steady_clock::now();
+                if (header->head.load(std::memory_order_acquire) <= pos) {
+                    stuck_since = std::chrono::steady_clock::time_point::max();
+                } else if (stuck_since == std::chrono::steady_clock::time_point::max()) {
+                    stuck_since = now;
+                } else if (now - stuck_since > std::chrono::milliseconds(STUCK_TIMEOUT_MS)) {
+                    pos++;
+                    lost++;
+                    stuck_since = std::chrono::steady_clock::time_point::max();
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                break;
+            }
+        }
+    }
+
+    fflush(stdout);
+    std::cerr << "trace_shm_tail: " << lost << " records overwritten before they were read, "
+              << header->dropped.load(std::memory_order_relaxed) << " dropped by producers" << std::endl;
+    return 0;
+}
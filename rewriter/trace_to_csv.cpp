@@ -0,0 +1,50 @@
+/**
+ * Converts a binary trace into the CSV that log_csv.py reads.
+ *
+ * g++ -O2 -std=c++17 trace_to_csv.cpp trace_reader.cpp -o trace_to_csv
+ * ./trace_to_csv log.trace > log.csv
+ */
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "trace_reader.h"
+
+int main(int argc, const char **argv) {
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " [path to binary trace]" << std::endl;
+        return 1;
+    }
+
+    std::string error;
+    std::unique_ptr<trace_reader> reader = trace_reader::load(argv[1], error);
+    if (!reader) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    if (reader->truncated())
+        std::cerr << "warning: ignoring a partially written segment at the end of " << argv[1] << std::endl;
+
+    static char buffer[1 << 20];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+    printf("variable_id,timestamp_ns,value,sample_rate,repeats\n");
+    std::vector<trace_record> records;
+    int status = 0;
+    for (const trace_segment &segment: reader->segments()) {
+        for (uint32_t v = 0; v < segment.num_variables; v++) {
+            records.clear();
+            if (!trace_reader::read(segment.span(v), records)) {
+                std::cerr << "error: corrupt block for variable " << segment.index[v].varid << std::endl;
+                status = 1;
+                continue;
+            }
+            for (const trace_record &r: records) {
+                printf("%u,%lld,%g,%g,%u\n", r.varid, static_cast<long long>(r.timestamp), trace_decode(r.type, r.bits),
+                       trace_sample_rate(r.sample_skip), r.repeats);
+            }
+        }
+    }
+    return status;
+}
@@ -0,0 +1,115 @@
+/**
+ * Prints the variables an instrumented binary describes in its
+ * sa4u_variables section (see instrumentation.cpp), as the name,id CSV the
+ * rewriter writes to variable_names.csv. With --details, also prints each
+ * variable's kind, width and where it was first instrumented.
+ *
+ * g++ -O2 -std=c++17 trace_variables.cpp -o trace_variables
+ * ./trace_variables instrumented_binary [--details] > variable_names.csv
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+
+extern "C" {
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "instrumentation.cpp"
+
+#define INTEGRAL_TYPE 0
+#define FLOATING_TYPE 1
+
+// Returns the contents of the named section of a 64-bit ELF file, or
+// nullptr if it has none.
+static const char *find_section(const char *data, size_t size, const char *name, size_t &section_size) {
+    auto *header = reinterpret_cast<const Elf64_Ehdr*>(data);
+    if (header->e_shoff == 0 || header->e_shentsize != sizeof(Elf64_Shdr) || header->e_shstrndx >= header->e_shnum ||
+        header->e_shoff + header->e_shnum * sizeof(Elf64_Shdr) > size)
+        return nullptr;
+    auto *sections = reinterpret_cast<const Elf64_Shdr*>(data + header->e_shoff);
+    const Elf64_Shdr &names = sections[header->e_shstrndx];
+    if (names.sh_offset + names.sh_size > size) return nullptr;
+
+    for (unsigned i = 0; i < header->e_shnum; i++) {
+        const Elf64_Shdr &section = sections[i];
+        if (section.sh_name >= names.sh_size || section.sh_type != SHT_PROGBITS ||
+            section.sh_offset + section.sh_size > size)
+            continue;
+        const char *section_name = data + names.sh_offset + section.sh_name;
+        if (strncmp(section_name, name, names.sh_size - section.sh_name) == 0) {
+            section_size = section.sh_size;
+            return data + section.sh_offset;
+        }
+    }
+    return nullptr;
+}
+
+int main(int argc, const char **argv) {
+    bool details = argc == 3 && std::string(argv[2]) == "--details";
+    if (argc != 2 && !details) {
+        std::cerr << "usage: " << argv[0] << " [path to instrumented binary] [--details]" << std::endl;
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "cannot open " << argv[1] << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    size_t size = st.st_size;
+    void *data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "cannot map " << argv[1] << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    const char *bytes = static_cast<const char*>(data);
+    if (size < sizeof(Elf64_Ehdr) || memcmp(bytes, ELFMAG, SELFMAG) != 0 || bytes[EI_CLASS] != ELFCLASS64) {
+        std::cerr << argv[1] << " is not a 64-bit ELF file" << std::endl;
+        return 1;
+    }
+    size_t section_size = 0;
+    const char *section = find_section(bytes, size, _INSTRUMENT_VARIABLES_SECTION, section_size);
+    if (!section) {
+        std::cerr << argv[1] << " has no " << _INSTRUMENT_VARIABLES_SECTION << " section" << std::endl;
+        return 1;
+    }
+
+    // A variable stored to in several files is described by each; keep
+    // the first.
+    std::map<unsigned, const _instrument_variable*> variables;
+    size_t offset = 0;
+    while (offset + sizeof(_instrument_variable) <= section_size) {
+        auto *v = reinterpret_cast<const _instrument_variable*>(section + offset);
+        if (v->magic != _INSTRUMENT_VARIABLE_MAGIC || v->record_size < sizeof(*v) + v->name_size ||
+            offset + v->record_size > section_size) {
+            offset += 8;
+            continue;
+        }
+        variables.emplace(v->varid, v);
+        offset += (v->record_size + 7) & ~7u;
+    }
+
+    printf(details ? "name,id,kind,width,file,line\n" : "name,id\n");
+    for (const auto &pair: variables) {
+        const _instrument_variable &v = *pair.second;
+        const char *name = reinterpret_cast<const char*>(&v + 1);
+        if (!details) {
+            printf("%s,%u\n", name, v.varid);
+            continue;
+        }
+        const char *kind = v.vartype == FLOATING_TYPE ? "float" : v.is_signed ? "signed" : "unsigned";
+        printf("%s,%u,%s,%u,%s,%u\n", name, v.varid, kind, v.size, name + v.name_size, v.line);
+    }
+    return 0;
+}